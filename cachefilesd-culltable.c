@@ -0,0 +1,306 @@
+/* CacheFiles userspace management daemon cull tables
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ * Based on the cull table code in cachefilesd.c,
+ * Copyright (C) 2006-2007 Red Hat, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "cachefilesd-culltable.h"
+
+/*****************************************************************************/
+/*
+ * change the number of slots in a cull table, keeping what's in it
+ * - when shrinking, the newest objects are handed to drop()
+ * - returns 0 or -ENOMEM, in which case the table is unchanged apart from
+ *   having been trimmed
+ */
+int cull_table_resize(struct cull_table *t, unsigned size,
+		      void (*drop)(struct cull_table *t, struct object *object))
+{
+	struct cull_entry *entries;
+	int excess, loop;
+
+	excess = t->oldest + 1 - (int)size;
+	if (excess > 0) {
+		for (loop = 0; loop < excess; loop++)
+			drop(t, t->entries[loop].object);
+		memmove(&t->entries[0], &t->entries[excess],
+			size * sizeof(t->entries[0]));
+		t->oldest -= excess;
+	}
+
+	entries = realloc(t->entries, size * sizeof(t->entries[0]));
+	if (!entries)
+		return -ENOMEM;
+
+	t->entries = entries;
+	t->size = size;
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * release a cull table's slots
+ * - any objects still in it must have been dealt with by the caller
+ */
+void cull_table_free(struct cull_table *t)
+{
+	free(t->entries);
+	t->entries = NULL;
+	t->size = 0;
+	t->oldest = -1;
+}
+
+/*****************************************************************************/
+/*
+ * set a cull table entry to refer to an object
+ */
+static inline void fill_cull_entry(struct cull_entry *entry,
+				   struct cull_key key, struct object *object)
+{
+	entry->key = key;
+	entry->object = object;
+}
+
+/*****************************************************************************/
+/*
+ * insert an object into a cull table if it's old enough
+ * - if full is set, the newest object is displaced to make room and handed
+ *   back through *_displaced
+ * - returns 1 if the object was inserted, 0 if it was too young and
+ *   -EOVERFLOW if the table is overfull
+ */
+int cull_table_insert(struct cull_table *t, struct cull_key key,
+		      struct object *object, int full,
+		      struct object **_displaced)
+{
+	int y, o, m;
+
+	*_displaced = NULL;
+
+	/* there must be a few entries before a table can be full */
+	if (t->oldest < 2)
+		full = 0;
+
+	/* just insert if table is empty */
+	if (t->oldest == -1) {
+		t->oldest = 0;
+		fill_cull_entry(&t->entries[0], key, object);
+		return 1;
+	}
+
+	/* insert somewhere if table is not full */
+	if (!full) {
+		t->oldest++;
+
+		/* just insert at end if new oldest object */
+		if (cull_key_cmp(&key, &t->entries[t->oldest - 1].key) <= 0) {
+			fill_cull_entry(&t->entries[t->oldest], key, object);
+			return 1;
+		}
+
+		/* insert at front if new newest object */
+		if (cull_key_cmp(&key, &t->entries[0].key) > 0) {
+			memmove(&t->entries[1],
+				&t->entries[0],
+				t->oldest * sizeof(t->entries[0]));
+
+			fill_cull_entry(&t->entries[0], key, object);
+			return 1;
+		}
+
+		/* if only two objects in list then insert between them */
+		if (t->oldest == 2) {
+			t->entries[2] = t->entries[1];
+			fill_cull_entry(&t->entries[1], key, object);
+			return 1;
+		}
+
+		/* insert somewhere in between front and back elements
+		 * of a three object list
+		 * - t->oldest == #objects_currently_in_list
+		 */
+		y = 1;
+		o = t->oldest - 1;
+
+		do {
+			m = (y + o) / 2;
+
+			if (cull_key_cmp(&key, &t->entries[m].key) > 0)
+				o = m;
+			else
+				y = m + 1;
+
+		} while (y < o);
+
+		memmove(&t->entries[y + 1],
+			&t->entries[y],
+			(t->oldest - y) * sizeof(t->entries[0]));
+
+		fill_cull_entry(&t->entries[y], key, object);
+		return 1;
+	}
+
+	/* if table is full then insert only if older than newest */
+	if (t->oldest > (int)t->size - 1)
+		return -EOVERFLOW;
+
+	if (cull_key_cmp(&key, &t->entries[0].key) >= 0)
+		return 0;
+
+	/* newest object in table will be displaced by this one */
+	*_displaced = t->entries[0].object;
+	t->entries[0].object = (void *)(0x6b000000 | __LINE__);
+
+	/* place directly in first slot if second is older */
+	if (cull_key_cmp(&key, &t->entries[1].key) >= 0) {
+		fill_cull_entry(&t->entries[0], key, object);
+		return 1;
+	}
+
+	/* shift everything up one if older than oldest */
+	if (cull_key_cmp(&key, &t->entries[t->oldest].key) <= 0) {
+		memmove(&t->entries[0],
+			&t->entries[1],
+			t->oldest * sizeof(t->entries[0]));
+
+		fill_cull_entry(&t->entries[t->oldest], key, object);
+		return 1;
+	}
+
+	/* search the table to find the insertion point
+	 * - it will be between the first and last the slots
+	 * - we know second is younger
+	 */
+	t->entries[0] = t->entries[1];
+
+	y = 2;
+	o = t->oldest;
+
+	do {
+		m = (y + o) / 2;
+
+		if (cull_key_cmp(&key, &t->entries[m].key) >= 0)
+			o = m;
+		else
+			y = m + 1;
+
+	} while (y < o);
+
+	if (y == 2) {
+		fill_cull_entry(&t->entries[1], key, object);
+		return 1;
+	}
+
+	memmove(&t->entries[1],
+		&t->entries[2],
+		(y - 2) * sizeof(t->entries[0]));
+
+	fill_cull_entry(&t->entries[y - 1], key, object);
+	return 1;
+}
+
+/*****************************************************************************/
+/*
+ * remove an object from a cull table
+ * - returns 1 if the object was found, 0 otherwise
+ */
+int cull_table_remove(struct cull_table *t, struct object *object)
+{
+	int loop;
+
+	for (loop = 0; loop <= t->oldest; loop++)
+		if (t->entries[loop].object == object)
+			break;
+
+	if (loop > t->oldest)
+		return 0;
+
+	/* shift down anything older than the object */
+	memmove(&t->entries[loop],
+		&t->entries[loop + 1],
+		(t->oldest - loop) * sizeof(t->entries[0]));
+	t->entries[t->oldest].object = (void *)(0x6b000000 | __LINE__);
+	t->oldest--;
+	return 1;
+}
+
+/*****************************************************************************/
+/*
+ * take the oldest object out of a cull table
+ * - returns NULL if the table is empty
+ */
+struct object *cull_table_pop(struct cull_table *t)
+{
+	struct object *object;
+
+	if (t->oldest < 0)
+		return NULL;
+
+	object = t->entries[t->oldest].object;
+	t->entries[t->oldest].object = (void *)(0x6b000000 | __LINE__);
+	t->oldest--;
+	return object;
+}
+
+/*****************************************************************************/
+/*
+ * decant the oldest entries from the build table to the ready table, as many
+ * as there's space for
+ * - the decanted entries are put at the young end of the ready table, so the
+ *   ready table is made up of sorted runs rather than being sorted overall
+ * - returns the number of entries decanted, which will be at the front of the
+ *   ready table, or -EOVERFLOW if a table is overfull
+ */
+int cull_table_decant(struct cull_table *build, struct cull_table *ready)
+{
+	int space, avail, copy, leave, n;
+
+	/* if the ready table is empty, copy the whole lot across */
+	if (ready->oldest == -1) {
+		copy = build->oldest + 1;
+		if (copy > (int)ready->size)
+			return -EOVERFLOW;
+
+		n = copy * sizeof(ready->entries[0]);
+		memcpy(ready->entries, build->entries, n);
+		memset(build->entries, 0x6e, n);
+		ready->oldest = build->oldest;
+		build->oldest = -1;
+		return copy;
+	}
+
+	/* decant some of the build table if there's space */
+	space = ready->size - (ready->oldest + 1);
+	if (space <= 0)
+		return space < 0 ? -EOVERFLOW : 0;
+
+	/* work out how much of the build table we can copy */
+	copy = avail = build->oldest + 1;
+	if (copy > space)
+		copy = space;
+	leave = avail - copy;
+
+	/* make a hole in the ready table transfer "copy" elements from the end
+	 * of the build table (oldest) to the beginning of the ready table
+	 * (youngest)
+	 */
+	n = ready->oldest + 1;
+	memmove(&ready->entries[copy], &ready->entries[0],
+		n * sizeof(ready->entries[0]));
+	ready->oldest += copy;
+
+	memcpy(&ready->entries[0], &build->entries[leave],
+	       copy * sizeof(ready->entries[0]));
+	memset(&build->entries[leave], 0x6b, copy * sizeof(build->entries[0]));
+	build->oldest = leave - 1;
+	return copy;
+}
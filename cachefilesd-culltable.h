@@ -0,0 +1,72 @@
+/* CacheFiles userspace management daemon cull tables
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ * Based on the cull table code in cachefilesd.c,
+ * Copyright (C) 2006-2007 Red Hat, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * A cull table is an array of objects ranked by the time they were last
+ * accessed, the newest at index 0 and the oldest at index t->oldest.  The
+ * objects are opaque here; the caller holds a reference on each object it
+ * puts in a table and must drop those handed back to it.
+ *
+ * The access times are kept to the nanosecond, and objects accessed at the
+ * same time are ranked by inode number, so that no two objects rank the same
+ * and the order doesn't depend on the order the objects were found in.
+ *
+ * The functions return negative error codes rather than aborting so that they
+ * can be driven outside of the daemon.
+ */
+
+#ifndef _CACHEFILESD_CULLTABLE_H
+#define _CACHEFILESD_CULLTABLE_H
+
+struct object;
+
+struct cull_key {
+	long long		atime;	/* ns since the epoch */
+	unsigned long long	ino;	/* tie breaker */
+};
+
+struct cull_entry {
+	struct cull_key	key;		/* ranking key */
+	struct object	*object;
+};
+
+struct cull_table {
+	struct cull_entry *entries;
+	unsigned	size;		/* number of slots */
+	int		oldest;		/* index of oldest entry or -1 if empty */
+};
+
+#define CULL_TABLE_INIT	{ .entries = NULL, .size = 0, .oldest = -1 }
+
+/*
+ * compare two ranking keys, returning <0 if a was accessed before b
+ */
+static inline int cull_key_cmp(const struct cull_key *a,
+			       const struct cull_key *b)
+{
+	if (a->atime != b->atime)
+		return a->atime < b->atime ? -1 : 1;
+	return a->ino < b->ino ? -1 : a->ino > b->ino;
+}
+
+extern int cull_table_resize(struct cull_table *t, unsigned size,
+			     void (*drop)(struct cull_table *t,
+					  struct object *object));
+extern void cull_table_free(struct cull_table *t);
+extern int cull_table_insert(struct cull_table *t, struct cull_key key,
+			     struct object *object, int full,
+			     struct object **_displaced);
+extern int cull_table_remove(struct cull_table *t, struct object *object);
+extern int cull_table_decant(struct cull_table *build,
+			     struct cull_table *ready);
+extern struct object *cull_table_pop(struct cull_table *t);
+
+#endif /* _CACHEFILESD_CULLTABLE_H */
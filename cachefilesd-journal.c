@@ -0,0 +1,333 @@
+/* CacheFiles userspace management daemon journal decoder
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * Decode the binary journal written by cachefilesd, or replay it to work out
+ * what was in the cull tables at some point:
+ *
+ *	cachefilesd-journal [-s <seq>] [-t <secs>] <journal>
+ *	cachefilesd-journal -r [-s <seq>] [-t <secs>] <journal>
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cachefilesd-journal.h"
+
+static const char *event_names[CFJ_NR_EVENTS] = {
+	[CFJ_DISCOVER]	= "discover",
+	[CFJ_INSERT]	= "insert",
+	[CFJ_DISPLACE]	= "displace",
+	[CFJ_REMOVE]	= "remove",
+	[CFJ_DECANT]	= "decant",
+	[CFJ_CULL]	= "cull",
+	[CFJ_DROP]	= "drop",
+	[CFJ_BUSY]	= "busy",
+	[CFJ_REAP]	= "reap",
+};
+
+/* what the replay thinks is in the cull tables, hashed by inode number */
+enum table { NO_TABLE, BUILD_TABLE, READY_TABLE };
+
+struct entry {
+	uint64_t	ino;		/* 0 if slot unused */
+	int64_t		atime;		/* ns */
+	uint64_t	blocks;
+	enum table	table;
+	char		name[CFJ_NAME_MAX];
+};
+
+static struct entry *entries;
+static unsigned long nentries, entries_mask;
+
+static __attribute__((noreturn, format(printf, 1, 2)))
+void error(const char *fmt, ...)
+{
+	va_list va;
+
+	fprintf(stderr, "cachefilesd-journal: ");
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+static __attribute__((noreturn))
+void help(void)
+{
+	fprintf(stderr,
+		"Format:\n"
+		"  /sbin/cachefilesd-journal [-r] [-s <seq>] [-t <secs>] <journal>\n"
+		"\n"
+		"Options:\n"
+		"  -r\tReplay the journal and show the cull tables\n"
+		"  -s <seq>\tStop before record <seq>\n"
+		"  -t <secs>\tStop at <secs> seconds after the daemon started\n"
+		);
+	exit(2);
+}
+
+/*****************************************************************************/
+/*
+ * find an object's entry in the replay, making one if there isn't one
+ */
+static struct entry *find_entry(uint64_t ino)
+{
+	struct entry *old;
+	unsigned long h, loop, size;
+
+	if (nentries >= entries_mask / 2) {
+		old = entries;
+		size = entries_mask + 1;
+
+		entries_mask = entries_mask ? entries_mask * 2 + 1 : 4095;
+		entries = calloc(entries_mask + 1, sizeof(entries[0]));
+		if (!entries)
+			error("Out of memory");
+
+		nentries = 0;
+		for (loop = 0; old && loop < size; loop++)
+			if (old[loop].ino)
+				*find_entry(old[loop].ino) = old[loop];
+		free(old);
+	}
+
+	for (h = ino * 0x9e3779b97f4a7c15ULL >> 20;; h++) {
+		h &= entries_mask;
+		if (entries[h].ino == ino)
+			return &entries[h];
+		if (!entries[h].ino)
+			break;
+	}
+
+	entries[h].ino = ino;
+	nentries++;
+	return &entries[h];
+}
+
+/*****************************************************************************/
+/*
+ * apply a record to the replayed cull tables
+ */
+static void replay_record(const struct cfj_record *rec)
+{
+	struct entry *e;
+
+	switch (rec->event) {
+	case CFJ_INSERT:
+	case CFJ_DECANT:
+		e = find_entry(rec->ino);
+		e->atime = rec->atime;
+		e->blocks = rec->blocks;
+		e->table = rec->event == CFJ_INSERT ? BUILD_TABLE : READY_TABLE;
+		memcpy(e->name, rec->name, sizeof(e->name));
+		break;
+
+	case CFJ_DISPLACE:
+	case CFJ_REMOVE:
+	case CFJ_CULL:
+	case CFJ_DROP:
+		e = find_entry(rec->ino);
+		e->table = NO_TABLE;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static int entry_cmp(const void *_a, const void *_b)
+{
+	const struct entry *a = *(const struct entry **)_a;
+	const struct entry *b = *(const struct entry **)_b;
+
+	if (a->atime != b->atime)
+		return a->atime < b->atime ? -1 : 1;
+	return a->ino < b->ino ? -1 : a->ino > b->ino;
+}
+
+/*****************************************************************************/
+/*
+ * display one of the replayed cull tables, oldest (first to be culled) first
+ */
+static void show_table(enum table table, const char *label)
+{
+	struct entry **list;
+	unsigned long loop, n = 0;
+
+	list = malloc((nentries + 1) * sizeof(list[0]));
+	if (!list)
+		error("Out of memory");
+
+	for (loop = 0; entries && loop <= entries_mask; loop++)
+		if (entries[loop].ino && entries[loop].table == table)
+			list[n++] = &entries[loop];
+
+	qsort(list, n, sizeof(list[0]), entry_cmp);
+
+	printf("%s table: %lu objects\n", label, n);
+	for (loop = 0; loop < n; loop++)
+		printf("  %10lld.%09lld %10llu %12llu %s\n",
+		       (long long) list[loop]->atime / 1000000000,
+		       (long long) list[loop]->atime % 1000000000,
+		       (unsigned long long) list[loop]->blocks,
+		       (unsigned long long) list[loop]->ino,
+		       list[loop]->name);
+	free(list);
+}
+
+/*****************************************************************************/
+/*
+ * display a record
+ */
+static void show_record(const struct cfj_record *rec)
+{
+	const char *ev = NULL;
+
+	if (rec->event < CFJ_NR_EVENTS)
+		ev = event_names[rec->event];
+
+	printf("%10llu %6llu.%06llu %-8s %12llu %12llu %10lld.%09lld %10llu %4u %s\n",
+	       (unsigned long long) rec->seq,
+	       (unsigned long long) rec->usec / 1000000,
+	       (unsigned long long) rec->usec % 1000000,
+	       ev ?: "?",
+	       (unsigned long long) rec->ino,
+	       (unsigned long long) rec->parent,
+	       (long long) rec->atime / 1000000000,
+	       (long long) rec->atime % 1000000000,
+	       (unsigned long long) rec->blocks,
+	       rec->aux,
+	       rec->name);
+}
+
+/*****************************************************************************/
+/*
+ * decode or replay a journal
+ */
+int main(int argc, char *argv[])
+{
+	const struct cfj_header *hdr;
+	const struct cfj_record *recs, *rec;
+	struct cfj_record copy;
+	unsigned long long stop_seq = ~0ULL, stop_usec = ~0ULL;
+	struct stat st;
+	uint64_t head, first, seq;
+	time_t started;
+	void *map;
+	char *ep;
+	int replay = 0, opt, fd;
+
+	while (opt = getopt(argc, argv, "rs:t:"),
+	       opt != -1
+	       ) {
+		switch (opt) {
+		case 'r':
+			replay = 1;
+			break;
+
+		case 's':
+			stop_seq = strtoull(optarg, &ep, 10);
+			if (*ep || ep == optarg)
+				help();
+			break;
+
+		case 't':
+			stop_usec = strtod(optarg, &ep) * 1000000;
+			if (*ep || ep == optarg)
+				help();
+			break;
+
+		default:
+			help();
+		}
+	}
+
+	if (optind != argc - 1)
+		help();
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0)
+		error("Unable to open %s: %m", argv[optind]);
+	if (fstat(fd, &st) < 0)
+		error("Unable to stat %s: %m", argv[optind]);
+	if (st.st_size < CFJ_HEADER_SIZE)
+		error("%s is not a cachefilesd journal", argv[optind]);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		error("Unable to map %s: %m", argv[optind]);
+	close(fd);
+
+	hdr = map;
+	recs = map + CFJ_HEADER_SIZE;
+	if (hdr->magic != CFJ_MAGIC)
+		error("%s is not a cachefilesd journal", argv[optind]);
+	if (hdr->version != CFJ_VERSION ||
+	    hdr->record_size != sizeof(struct cfj_record))
+		error("%s is journal version %u, not %u",
+		      argv[optind], hdr->version, CFJ_VERSION);
+	if (hdr->nrecords == 0 ||
+	    CFJ_HEADER_SIZE + (unsigned long long) hdr->nrecords *
+	    sizeof(struct cfj_record) > (unsigned long long) st.st_size)
+		error("%s is truncated", argv[optind]);
+
+	/* the daemon may still be writing, so only go as far as the head was
+	 * when we started and skip records that get overwritten under us */
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	first = head > hdr->nrecords ? head - hdr->nrecords : 0;
+
+	started = hdr->start_usec / 1000000;
+	printf("# pid %u cache %s started %s",
+	       hdr->pid, hdr->cacheroot, ctime(&started));
+	printf("# records %llu-%llu of %llu\n",
+	       (unsigned long long) first, (unsigned long long) head,
+	       (unsigned long long) head);
+	if (replay && first > 0)
+		printf("# journal wrapped: objects inserted before record %llu"
+		       " are missing\n", (unsigned long long) first);
+
+	for (seq = first; seq < head && seq < stop_seq; seq++) {
+		rec = &recs[seq % hdr->nrecords];
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq)
+			continue;
+
+		/* take a copy, and then make sure the daemon didn't start
+		 * rewriting the slot whilst we were doing so */
+		copy = *rec;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (copy.usec >= stop_usec)
+			break;
+
+		if (replay)
+			replay_record(&copy);
+		else
+			show_record(&copy);
+	}
+
+	if (replay) {
+		show_table(READY_TABLE, "Ready");
+		show_table(BUILD_TABLE, "Build");
+	}
+
+	exit(0);
+}
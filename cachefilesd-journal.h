@@ -0,0 +1,72 @@
+/* CacheFiles userspace management daemon event journal format
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * The journal is a file that cachefilesd maps and treats as a ring of fixed
+ * size records.  The header says how many records the ring holds and how many
+ * have ever been written, so record N lives in slot N % nrecords and the
+ * oldest record still present is the one numbered head - nrecords (or 0).
+ *
+ * A record is rewritten in place.  Whilst that's happening its seq is
+ * CFJ_SEQ_BUSY, so a reader must check that seq is still what it expects
+ * after copying a record out.
+ *
+ * All fields are in the byte order of the machine the daemon ran on.
+ */
+
+#ifndef _CACHEFILESD_JOURNAL_H
+#define _CACHEFILESD_JOURNAL_H
+
+#include <stdint.h>
+
+#define CFJ_MAGIC		0x4a464643	/* "CFFJ" */
+#define CFJ_VERSION		2
+#define CFJ_HEADER_SIZE		4096		/* records start here */
+#define CFJ_NAME_MAX		72
+#define CFJ_SEQ_BUSY		(~0ULL)		/* record being rewritten */
+
+struct cfj_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	record_size;	/* sizeof(struct cfj_record) */
+	uint32_t	nrecords;	/* slots in the ring */
+	uint64_t	head;		/* number of records ever written */
+	uint64_t	start_usec;	/* wall clock time of record time 0 */
+	uint32_t	pid;		/* daemon writing the journal */
+	char		cacheroot[256];
+};
+
+enum cfj_event {
+	CFJ_DISCOVER	= 1,	/* object first seen by the scanner */
+	CFJ_INSERT,		/* object added to the build table */
+	CFJ_DISPLACE,		/* object pushed out of the full build table */
+	CFJ_REMOVE,		/* object taken out of a table (aux: 1 if ready) */
+	CFJ_DECANT,		/* object moved from build to ready table */
+	CFJ_CULL,		/* object culled (aux: files culled) */
+	CFJ_DROP,		/* object taken for culling but left alone */
+	CFJ_BUSY,		/* object found to be in use */
+	CFJ_REAP,		/* grave unlinked (blocks: size at unlink) */
+	CFJ_NR_EVENTS
+};
+
+struct cfj_record {
+	uint64_t	seq;		/* record number */
+	uint64_t	usec;		/* microseconds since daemon start */
+	uint64_t	ino;		/* inode number of object */
+	uint64_t	parent;		/* inode number of parent dir */
+	int64_t		atime;		/* cull ranking time (ns) */
+	uint64_t	blocks;		/* 512-byte blocks */
+	uint8_t		event;		/* enum cfj_event */
+	uint8_t		type;		/* object type */
+	uint16_t	__pad;
+	uint32_t	aux;		/* event specific */
+	char		name[CFJ_NAME_MAX];	/* object name, truncated */
+};
+
+#endif /* _CACHEFILESD_JOURNAL_H */
@@ -0,0 +1,307 @@
+/* CacheFiles userspace management daemon object tree
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ * Based on the object handling code in cachefilesd.c,
+ * Copyright (C) 2006-2007 Red Hat, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "cachefilesd-objtree.h"
+
+/*****************************************************************************/
+/*
+ * find the place in a parent's list of children for an inode number
+ * - the list is kept in descending inode number order
+ * - returns the first child with an inode number not greater than ino (or
+ *   NULL) and sets *_prev to the child before that
+ */
+struct object *object_find(struct object *parent, ino_t ino,
+			   struct object **_prev)
+{
+	struct object *p, *pr;
+
+	pr = NULL;
+	for (p = parent->children; p; pr = p, p = p->next)
+		if (p->ino <= ino)
+			break;
+
+	*_prev = pr;
+	return p;
+}
+
+/*****************************************************************************/
+/*
+ * create an object from a name and stat details and attach to the parent, if
+ * it doesn't already exist
+ * - if it does exist, another reference is taken on it
+ * - returns NULL with errno set to ENOMEM, or to EINVAL if the name isn't one
+ *   that CacheFiles makes
+ */
+struct object *object_create(struct object_tree *tree, struct object *parent,
+			     const char *name, const struct stat64 *st)
+{
+	struct object *object, *p, *pr;
+	objtype_t type;
+	int len;
+
+	/* see if the parent object already holds a representation of this
+	 * one */
+	p = object_find(parent, st->st_ino, &pr);
+	if (p && p->ino == st->st_ino) {
+		/* it does */
+		p->usage++;
+		return p;
+	}
+
+	switch (name[0]) {
+	case 'I':
+	case 'J':
+		type = OBJTYPE_INDEX;
+		break;
+	case 'D':
+	case 'E':
+		type = OBJTYPE_DATA;
+		break;
+	case 'S':
+	case 'T':
+		type = OBJTYPE_SPECIAL;
+		break;
+	case '+':
+	case '@':
+		type = OBJTYPE_INTERMEDIATE;
+		break;
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* allocate the object
+	 * - note that struct object reserves space for NUL directly
+	 */
+	len = strlen(name);
+
+	object = calloc(1, sizeof(struct object) + len);
+	if (!object)
+		return NULL;
+
+	object->usage = 1;
+	object->new = 1;
+	object->type = type;
+
+	object->ino = st->st_ino;
+	object->atime = stat_atime(st);
+	object->blocks = st->st_blocks;
+	memcpy(object->name, name, len + 1);
+
+	/* link into the parent's list */
+	parent->usage++;
+	object->parent = parent;
+	object->prev = pr;
+	object->next = p;
+	if (pr)
+		pr->next = object;
+	else
+		parent->children = object;
+	if (p)
+		p->prev = object;
+
+	tree->nobjects++;
+	tree->objmem += sizeof(struct object) + len;
+
+	if (tree->discover)
+		tree->discover(tree, object);
+	return object;
+}
+
+/*****************************************************************************/
+/*
+ * drop a reference to an object, freeing it and unlinking it from its parent
+ * if it was the last, and dropping the parent's reference in turn
+ * - returns 0 or -EINVAL if the last reference to the root or to an object
+ *   that still has children was dropped, in which case it's left as it was
+ */
+int object_put(struct object_tree *tree, struct object *object)
+{
+	struct object *parent;
+
+	for (; object; object = parent) {
+		if (--object->usage > 0)
+			return 0;
+
+		if (object == &tree->root || object->children) {
+			object->usage++;
+			return -EINVAL;
+		}
+
+		tree->nobjects--;
+		tree->objmem -= sizeof(struct object) + strlen(object->name);
+
+		if (object->dir) {
+			closedir(object->dir);
+			tree->nopendir--;
+		}
+
+		dirlist_free(object);
+		if (tree->release)
+			tree->release(tree, object);
+
+		/* destroy the object */
+		if (object->prev)
+			object->prev->next = object->next;
+		else
+			object->parent->children = object->next;
+
+		if (object->next)
+			object->next->prev = object->prev;
+
+		parent = object->parent;
+
+		memset(object, 0x6d, sizeof(struct object));
+		free(object);
+	}
+
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * get a file descriptor for a directory, reopening it by path from the
+ * nearest ancestor that's still open if need be
+ * - returns the fd, which the caller must close, -ENOENT if the directory or
+ *   one of its ancestors has gone or another negative error code
+ */
+int object_dir_fd(struct object *dir)
+{
+	int parentfd, fd;
+
+	if (dir->dir) {
+		fd = dup(dirfd(dir->dir));
+		return fd < 0 ? -errno : fd;
+	}
+
+	if (!dir->parent)
+		return -EBADF;
+
+	parentfd = object_dir_fd(dir->parent);
+	if (parentfd < 0)
+		return parentfd;
+
+	fd = openat(parentfd, dir->name, O_DIRECTORY);
+	if (fd < 0)
+		fd = -errno;
+
+	close(parentfd);
+	return fd;
+}
+
+/*****************************************************************************/
+/*
+ * compare directory entries by inode number
+ */
+static int dirlist_cmp(const void *_a, const void *_b)
+{
+	const struct dirlist_entry *a = _a, *b = _b;
+
+	return a->ino < b->ino ? -1 : a->ino > b->ino;
+}
+
+/*****************************************************************************/
+/*
+ * read the whole of an open directory into its entry list, sorting the
+ * entries into inode order if asked to
+ * - this may take several goes if the directory is large, expired() being
+ *   asked before each entry if we should give up for now
+ * - returns 1 when the list is complete, 0 if we ran out of time, -ENOENT if
+ *   the directory has been removed or another negative error code
+ */
+int dirlist_fill(struct object *dir, int sorted, int (*expired)(void))
+{
+	struct dirlist_entry *entries;
+	struct dirlist *list = dir->list;
+	struct dirent *de;
+	unsigned len, max;
+	char *names;
+
+	if (!list) {
+		list = dir->list = calloc(1, sizeof(*list));
+		if (!list)
+			return -ENOMEM;
+	}
+
+	for (;;) {
+		if (expired && expired())
+			return 0;
+
+		errno = 0;
+		de = readdir(dir->dir);
+		if (!de) {
+			if (errno == 0)
+				break;
+			return -errno;
+		}
+
+		/* ignore "." and ".." */
+		if (de->d_name[0] == '.') {
+			if (!de->d_name[1] ||
+			    (de->d_name[1] == '.' && !de->d_name[2]))
+				continue;
+		}
+
+		if (list->nentries >= list->maxentries) {
+			max = list->maxentries ? list->maxentries * 2 : 64;
+			entries = realloc(list->entries,
+					  max * sizeof(list->entries[0]));
+			if (!entries)
+				return -ENOMEM;
+			list->entries = entries;
+			list->maxentries = max;
+		}
+
+		len = strlen(de->d_name) + 1;
+		if (list->namesize + len > list->maxnames) {
+			max = list->maxnames ? list->maxnames * 2 : 4096;
+			names = realloc(list->names, max);
+			if (!names)
+				return -ENOMEM;
+			list->names = names;
+			list->maxnames = max;
+		}
+
+		list->entries[list->nentries].ino = de->d_ino;
+		list->entries[list->nentries].type = de->d_type;
+		list->entries[list->nentries].name = list->namesize;
+		memcpy(list->names + list->namesize, de->d_name, len);
+		list->namesize += len;
+		list->nentries++;
+	}
+
+	if (sorted)
+		qsort(list->entries, list->nentries, sizeof(list->entries[0]),
+		      dirlist_cmp);
+	list->complete = 1;
+	return 1;
+}
+
+/*****************************************************************************/
+/*
+ * discard the remains of a directory's entry list
+ */
+void dirlist_free(struct object *dir)
+{
+	if (dir->list) {
+		free(dir->list->entries);
+		free(dir->list->names);
+		free(dir->list);
+		dir->list = NULL;
+	}
+}
@@ -0,0 +1,133 @@
+/* CacheFiles userspace management daemon object tree
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ * Based on the object handling code in cachefilesd.c,
+ * Copyright (C) 2006-2007 Red Hat, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * The object tree mirrors the parts of the cache that are of interest, each
+ * object being pinned by the objects below it and by whoever is holding on to
+ * it (the cull tables, for instance).  The children of a directory are kept
+ * in descending inode number order.
+ *
+ * The tree's owner is told about objects coming and going through the
+ * discover() and release() hooks so that it can index them as it sees fit.
+ *
+ * A directory's entries are read into a list in one go, sorted into inode
+ * number order if wanted, so that statting them walks the inode table in
+ * order rather than in directory hash order.
+ *
+ * The functions return negative error codes or set errno rather than
+ * aborting so that they can be driven outside of the daemon.
+ */
+
+#ifndef _CACHEFILESD_OBJTREE_H
+#define _CACHEFILESD_OBJTREE_H
+
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define NSEC_PER_SEC		1000000000LL
+
+typedef enum objtype {
+	OBJTYPE_INDEX,
+	OBJTYPE_DATA,
+	OBJTYPE_SPECIAL,
+	OBJTYPE_INTERMEDIATE,
+} objtype_t;
+
+/* the entries of a directory being scanned */
+struct dirlist_entry {
+	ino_t		ino;		/* inode number from readdir */
+	unsigned	name;		/* offset of name in names buffer */
+	unsigned char	type;		/* type from readdir */
+};
+
+struct dirlist {
+	struct dirlist_entry *entries;
+	char		*names;
+	unsigned	nentries;	/* number of entries */
+	unsigned	maxentries;	/* space in entries[] */
+	unsigned	namesize;	/* amount of names[] used */
+	unsigned	maxnames;	/* space in names[] */
+	unsigned	pos;		/* next entry to scan */
+	char		complete;	/* T if the whole dir has been read */
+};
+
+struct object {
+	struct object	*parent;	/* parent dir of this object (or NULL) */
+	struct object	*children;	/* children of this object */
+	struct object	*next;		/* next child of parent */
+	struct object	*prev;		/* previous child of parent */
+	struct object	*hnext;		/* next object in inode hash bucket */
+	DIR		*dir;		/* this object's directory (or NULL for data obj) */
+	struct dirlist	*list;		/* entries left to scan in this dir (or NULL) */
+	ino_t		ino;		/* inode number of this object */
+	int		usage;		/* number of users of this object */
+	char		empty;		/* T if directory empty */
+	char		new;		/* T if object new */
+	char		cullable;	/* T if object now cullable */
+	objtype_t	type;		/* type of object */
+	long long	atime;		/* last access time on this object (ns) */
+	time_t		mtime;		/* last change to this directory */
+	blkcnt64_t	blocks;		/* 512-byte blocks occupied by this object */
+	int		ncandidates;	/* cull candidates found in this dir by last scan */
+
+	/* summary of a directory's subtree, gathered as it's scanned */
+	long long	sub_atime;	/* newest atime in subtree (ns) */
+	blkcnt64_t	sub_blocks;	/* 512-byte blocks in subtree */
+	unsigned	sub_files;	/* data objects in subtree */
+	char		sub_busy;	/* T if anything in subtree in use */
+	char		subtree;	/* T if in cull table as a whole subtree */
+	long long	subtree_atime;	/* sub_atime when it went in the table */
+	unsigned char	regrets;	/* times recreated soon after being culled */
+
+	char		name[1];	/* name of this object */
+};
+
+struct object_tree {
+	struct object	root;		/* cache root representation */
+	int		nobjects;	/* objects in the tree, root included */
+	int		nopendir;	/* directory streams held open */
+	unsigned long long objmem;	/* bytes of object representations */
+
+	/* called when an object is added to the tree and when it's about to
+	 * be freed; either may be NULL */
+	void (*discover)(struct object_tree *tree, struct object *object);
+	void (*release)(struct object_tree *tree, struct object *object);
+};
+
+#define OBJECT_TREE_INIT(d, r)						\
+	{								\
+		.root		= { .usage = 2, .type = OBJTYPE_INDEX },	\
+		.nobjects	= 1,					\
+		.discover	= (d),					\
+		.release	= (r),					\
+	}
+
+/*
+ * get a file's access time in nanoseconds
+ */
+static inline long long stat_atime(const struct stat64 *st)
+{
+	return st->st_atim.tv_sec * NSEC_PER_SEC + st->st_atim.tv_nsec;
+}
+
+extern struct object *object_find(struct object *parent, ino_t ino,
+				  struct object **_prev);
+extern struct object *object_create(struct object_tree *tree,
+				    struct object *parent, const char *name,
+				    const struct stat64 *st);
+extern int object_put(struct object_tree *tree, struct object *object);
+extern int object_dir_fd(struct object *dir);
+extern int dirlist_fill(struct object *dir, int sorted, int (*expired)(void));
+extern void dirlist_free(struct object *dir);
+
+#endif /* _CACHEFILESD_OBJTREE_H */
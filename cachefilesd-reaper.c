@@ -0,0 +1,494 @@
+/* CacheFiles userspace management daemon graveyard reaper
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ * Based on the graveyard reaping code in cachefilesd.c,
+ * Copyright (C) 2006-2007 Red Hat, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "cachefilesd-reaper.h"
+
+static int reap_grave(struct reaper *r, int dirfd, const char *name,
+		      unsigned char type);
+
+/*****************************************************************************/
+/*
+ * read the monotonic clock in microseconds
+ */
+static unsigned long long reap_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*****************************************************************************/
+/*
+ * note how long a reaping operation took
+ */
+static void note_reap_latency(struct reaper *r, unsigned long long start)
+{
+	unsigned long long us = reap_usec() - start;
+	int bucket = 0;
+
+	while (us > 1 && bucket < REAP_HIST_SIZE - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	r->latency_hist[bucket]++;
+}
+
+static int reap_expired(struct reaper *r)
+{
+	return r->expired && r->expired();
+}
+
+/*****************************************************************************/
+/*
+ * truncate a big file down in steps, yielding between steps if we run out of
+ * time; the next go carries on from where the file got to
+ * - big means a lot of space allocated, and each step gives back about the
+ *   step size of allocated space; on a sparse file that spans more of the
+ *   file's length
+ * - returns 1 when there's only a step left, 0 if we ran out of time or a
+ *   negative error code
+ */
+static int truncate_grave(struct reaper *r, int dirfd, const char *name,
+			  const struct stat64 *st)
+{
+	unsigned long long start, nsteps;
+	off64_t size, step;
+	int fd, ret = 1;
+
+	fd = openat(dirfd, name, O_WRONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return errno == ENOENT ? 1 : -errno;
+
+	nsteps = st->st_blocks * 512ULL / r->trunc_step;
+	if (nsteps == 0)
+		nsteps = 1;
+	step = st->st_size / nsteps;
+	if (step < (off64_t)r->trunc_step)
+		step = r->trunc_step;
+
+	size = st->st_size;
+	while (size > step) {
+		size -= step;
+
+		start = reap_usec();
+		if (ftruncate64(fd, size) < 0) {
+			ret = -errno;
+			break;
+		}
+		note_reap_latency(r, start);
+
+		if (reap_expired(r)) {
+			ret = 0;
+			break;
+		}
+	}
+
+	close(fd);
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * remove a file from a directory in the graveyard
+ * - big files are truncated down in steps first
+ * - returns 1 if the file is gone, 0 if we ran out of time, -EISDIR if it's
+ *   actually a directory or another negative error code
+ */
+static int reap_file(struct reaper *r, int dirfd, const char *name)
+{
+	unsigned long long start;
+	struct stat64 st;
+	int ret;
+
+	st.st_blocks = 0;
+	if (r->trunc_threshold || r->reaped) {
+		if (fstatat64(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			if (errno == ENOENT)
+				return 1;
+			return -errno;
+		}
+		if (S_ISDIR(st.st_mode))
+			return -EISDIR;
+
+		if (r->trunc_threshold &&
+		    S_ISREG(st.st_mode) &&
+		    st.st_blocks * 512ULL > r->trunc_threshold) {
+			ret = truncate_grave(r, dirfd, name, &st);
+			if (ret <= 0)
+				return ret;
+			if (r->reaped &&
+			    fstatat64(dirfd, name, &st,
+				      AT_SYMLINK_NOFOLLOW) < 0)
+				st.st_blocks = 0;
+		}
+	}
+
+	start = reap_usec();
+	if (unlinkat(dirfd, name, 0) < 0) {
+		if (errno == EISDIR)
+			return -EISDIR;
+		if (errno != ENOENT)
+			return -errno;
+	}
+	note_reap_latency(r, start);
+
+	if (r->reaped)
+		r->reaped(r, name, st.st_blocks, 0);
+	return 1;
+}
+
+/*****************************************************************************/
+/*
+ * empty a directory in the graveyard, closing the fd when done
+ * - removing directory entries may cause us to skip when reading them, so we
+ *   go round again until a pass finds nothing
+ * - returns 1 if the directory was emptied, 0 if we ran out of time or a
+ *   negative error code
+ */
+static int reap_dir(struct reaper *r, int fd)
+{
+	struct dirent *de;
+	DIR *dir;
+	int deleted, ret;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	do {
+		rewinddir(dir);
+		deleted = 0;
+
+		for (;;) {
+			errno = 0;
+			de = readdir(dir);
+			if (!de) {
+				if (errno != 0) {
+					ret = -errno;
+					goto out;
+				}
+				break;
+			}
+
+			/* ignore "." and ".." */
+			if (de->d_name[0] == '.') {
+				if (!de->d_name[1] ||
+				    (de->d_name[1] == '.' && !de->d_name[2]))
+					continue;
+			}
+
+			deleted = 1;
+
+			if (reap_expired(r)) {
+				ret = 0;
+				goto out;
+			}
+
+			ret = reap_grave(r, dirfd(dir), de->d_name,
+					 de->d_type);
+			if (ret <= 0)
+				goto out;
+		}
+	} while (deleted);
+
+	ret = 1;
+out:
+	closedir(dir);
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * remove a file or a whole directory tree from the graveyard
+ * - type is the readdir type, if known, or DT_UNKNOWN
+ * - returns 1 if it's gone, 0 if we ran out of time or a negative error code
+ */
+static int reap_grave(struct reaper *r, int dirfd, const char *name,
+		      unsigned char type)
+{
+	unsigned long long start;
+	int fd, ret;
+
+	/* attempt to unlink non-directory files */
+	if (type != DT_DIR) {
+		ret = reap_file(r, dirfd, name);
+		if (ret != -EISDIR)
+			return ret;
+	}
+
+	/* recurse into directories */
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0)
+		return errno == ENOENT ? 1 : -errno;
+
+	ret = reap_dir(r, fd);
+	if (ret <= 0)
+		return ret;
+
+	/* which we then attempt to remove */
+	start = reap_usec();
+	if (unlinkat(dirfd, name, AT_REMOVEDIR) < 0 && errno != ENOENT)
+		return -errno;
+	note_reap_latency(r, start);
+
+	if (r->reaped)
+		r->reaped(r, name, 0, 1);
+	return 1;
+}
+
+/*****************************************************************************/
+/*
+ * remove a grave, which may be a file or a directory tree, from the directory
+ * it's in
+ * - returns 1 if it's gone, 0 if we ran out of time or a negative error code
+ */
+int reaper_reap_grave(struct reaper *r, int dirfd, const char *name)
+{
+	return reap_grave(r, dirfd, name, DT_UNKNOWN);
+}
+
+/*****************************************************************************/
+/*
+ * add up the blocks and inodes in a grave
+ * - big directory graves aren't fully explored; once the budget is used up
+ *   they're heavy enough to be near the front anyway
+ */
+static void size_grave(int dirfd, const char *name,
+		       unsigned long long *_blocks, unsigned long long *_files,
+		       int *_budget)
+{
+	struct dirent *de;
+	struct stat64 st;
+	DIR *dir;
+	int fd;
+
+	if (fstatat64(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return;
+
+	*_blocks += st.st_blocks;
+	*_files += 1;
+
+	if (!S_ISDIR(st.st_mode) || *_budget <= 0)
+		return;
+
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return;
+	}
+
+	while (*_budget > 0 && (de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		(*_budget)--;
+		size_grave(fd, de->d_name, _blocks, _files, _budget);
+	}
+
+	closedir(dir);
+}
+
+/*****************************************************************************/
+/*
+ * rank graves by weight, heaviest first
+ */
+static int grave_cmp(const void *_a, const void *_b)
+{
+	const struct grave *a = _a, *b = _b;
+
+	return a->weight > b->weight ? -1 : a->weight < b->weight;
+}
+
+/*****************************************************************************/
+/*
+ * rank the graves not yet reaped by how much of what we're short of they'll
+ * give back
+ */
+static void sort_graves(struct reaper *r, enum reap_pressure pressure)
+{
+	int loop;
+
+	for (loop = r->next_grave; loop < r->ngraves; loop++)
+		r->graves[loop].weight = pressure == BLOCK_PRESSURE ?
+			r->graves[loop].blocks : r->graves[loop].files;
+
+	qsort(r->graves + r->next_grave, r->ngraves - r->next_grave,
+	      sizeof(struct grave), grave_cmp);
+	r->ranked_by = pressure;
+}
+
+/*****************************************************************************/
+/*
+ * size up the graves and rank them
+ * - returns 1 when done, 0 if we ran out of time, in which case we carry on
+ *   where we left off next time, or a negative error code
+ */
+static int rank_graves(struct reaper *r, enum reap_pressure pressure)
+{
+	unsigned long long blocks, files;
+	struct dirent *de;
+	int fd, budget, ret;
+
+	if (!r->graves) {
+		r->graves = malloc(GRAVES_MAX * sizeof(struct grave));
+		if (!r->graves)
+			return -ENOMEM;
+	}
+
+	if (!r->ranking) {
+		r->ngraves = 0;
+		r->next_grave = 0;
+
+		fd = openat(r->graveyardfd, ".", O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			return -errno;
+		r->ranking = fdopendir(fd);
+		if (!r->ranking) {
+			ret = -errno;
+			close(fd);
+			return ret;
+		}
+	}
+
+	while (r->ngraves < GRAVES_MAX) {
+		if (reap_expired(r))
+			return 0;
+
+		de = readdir(r->ranking);
+		if (!de)
+			break;
+
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		blocks = files = 0;
+		budget = GRAVE_SIZE_BUDGET;
+		size_grave(dirfd(r->ranking), de->d_name, &blocks, &files,
+			   &budget);
+		if (!files)
+			continue;
+
+		r->graves[r->ngraves].blocks = blocks;
+		r->graves[r->ngraves].files = files;
+		r->graves[r->ngraves].isdir = files > 1 || de->d_type == DT_DIR;
+		strcpy(r->graves[r->ngraves].name, de->d_name);
+		r->ngraves++;
+	}
+
+	closedir(r->ranking);
+	r->ranking = NULL;
+
+	sort_graves(r, pressure);
+	return 1;
+}
+
+/*****************************************************************************/
+/*
+ * whilst the cache is short of space or files, reap the heaviest graves
+ * first
+ * - returns 1 when done, 0 if we ran out of time or a negative error code
+ */
+static int reap_heaviest_graves(struct reaper *r, enum reap_pressure pressure)
+{
+	struct grave *grave;
+	int ret;
+
+	if (pressure == NO_PRESSURE) {
+		if (r->ranking) {
+			closedir(r->ranking);
+			r->ranking = NULL;
+		}
+		r->ngraves = 0;
+		return 1;
+	}
+
+	/* what we're short of may have changed since the graves were ranked */
+	if (r->ranking || r->next_grave >= r->ngraves) {
+		ret = rank_graves(r, pressure);
+		if (ret <= 0)
+			return ret;
+	}
+	else if (pressure != r->ranked_by) {
+		sort_graves(r, pressure);
+	}
+
+	while (r->next_grave < r->ngraves) {
+		if (reap_expired(r))
+			return 0;
+
+		grave = &r->graves[r->next_grave];
+		ret = reap_grave(r, r->graveyardfd, grave->name,
+				 grave->isdir ? DT_DIR : DT_UNKNOWN);
+		if (ret <= 0)
+			return ret;
+		r->next_grave++;
+	}
+
+	return 1;
+}
+
+/*****************************************************************************/
+/*
+ * reap the graveyard, the heaviest graves first if the cache is under
+ * pressure
+ * - returns 1 when the graveyard is empty, 0 if we ran out of time or a
+ *   negative error code
+ */
+int reaper_reap(struct reaper *r, enum reap_pressure pressure)
+{
+	int fd, ret;
+
+	ret = reap_heaviest_graves(r, pressure);
+	if (ret <= 0)
+		return ret;
+
+	fd = openat(r->graveyardfd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return -errno;
+	return reap_dir(r, fd);
+}
+
+/*****************************************************************************/
+/*
+ * release what the reaper holds, other than the graveyard fd
+ */
+void reaper_free(struct reaper *r)
+{
+	if (r->ranking) {
+		closedir(r->ranking);
+		r->ranking = NULL;
+	}
+	free(r->graves);
+	r->graves = NULL;
+	r->ngraves = 0;
+	r->next_grave = 0;
+}
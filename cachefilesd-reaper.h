@@ -0,0 +1,91 @@
+/* CacheFiles userspace management daemon graveyard reaper
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ * Based on the graveyard reaping code in cachefilesd.c,
+ * Copyright (C) 2006-2007 Red Hat, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * The reaper deletes whatever has been moved into the graveyard, a bit at a
+ * time: expired() is asked between operations whether it should give up for
+ * now, and the next call carries on from where it got to.
+ *
+ * When the cache is short of space or files, the graves that will give back
+ * the most of whatever is short are reaped first.  Freeing all the extents of
+ * a huge file in one go can stall the backing filesystem's journal, so big
+ * graves are truncated down a step at a time before being unlinked.
+ *
+ * Everything is done relative to directory fds; the current directory is left
+ * alone.  The functions return negative error codes rather than aborting so
+ * that they can be driven outside of the daemon.
+ */
+
+#ifndef _CACHEFILESD_REAPER_H
+#define _CACHEFILESD_REAPER_H
+
+#include <dirent.h>
+#include <limits.h>
+
+#define GRAVES_MAX		1024	/* graves ranked at a time */
+#define GRAVE_SIZE_BUDGET	256	/* entries looked at to size a dir grave */
+
+#define REAP_TRUNC_THRESHOLD_DEFAULT	(1024ULL * 1024 * 1024)
+#define REAP_TRUNC_STEP_DEFAULT		(128ULL * 1024 * 1024)
+
+/* log2 histogram of how long each reaping operation took (us) */
+#define REAP_HIST_SIZE		32
+
+enum reap_pressure {
+	NO_PRESSURE,
+	BLOCK_PRESSURE,
+	FILE_PRESSURE,
+};
+
+struct grave {
+	unsigned long long	weight;		/* blocks or inodes in grave */
+	unsigned long long	blocks;		/* blocks in grave */
+	unsigned long long	files;		/* inodes in grave */
+	int			isdir;		/* T if grave is a directory */
+	char			name[NAME_MAX + 1];
+};
+
+struct reaper {
+	int		graveyardfd;		/* the graveyard directory */
+	unsigned long long trunc_threshold;	/* bytes; 0 to never truncate */
+	unsigned long long trunc_step;		/* bytes given back per step */
+
+	/* T if the reaper should give up for now; may be NULL */
+	int (*expired)(void);
+
+	/* called after each file or directory is removed, with the 512-byte
+	 * blocks a file had; may be NULL, which saves statting files that
+	 * aren't big enough to truncate */
+	void (*reaped)(struct reaper *r, const char *name,
+		       unsigned long long blocks, int isdir);
+
+	unsigned long long latency_hist[REAP_HIST_SIZE];
+
+	struct grave	*graves;		/* ranked graves, heaviest first */
+	int		ngraves, next_grave;
+	DIR		*ranking;		/* graveyard being sized, if any */
+	enum reap_pressure ranked_by;		/* what the graves are ranked by */
+};
+
+#define REAPER_INIT(e, r)						\
+	{								\
+		.graveyardfd	 = -1,					\
+		.trunc_threshold = REAP_TRUNC_THRESHOLD_DEFAULT,	\
+		.trunc_step	 = REAP_TRUNC_STEP_DEFAULT,		\
+		.expired	 = (e),					\
+		.reaped		 = (r),					\
+	}
+
+extern int reaper_reap(struct reaper *r, enum reap_pressure pressure);
+extern int reaper_reap_grave(struct reaper *r, int dirfd, const char *name);
+extern void reaper_free(struct reaper *r);
+
+#endif /* _CACHEFILESD_REAPER_H */
@@ -0,0 +1,74 @@
+/* CacheFiles userspace management daemon XFS bulkstat interface
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * The v5 bulkstat structures and ioctl from <xfs/xfs_fs.h>, copied here
+ * because xfsprogs' headers aren't always installed.  tests/xfs-layout-test.c
+ * checks them against the system header where there is one.
+ */
+
+#ifndef _CACHEFILESD_XFS_H
+#define _CACHEFILESD_XFS_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#ifndef XFS_IOC_BULKSTAT
+struct xfs_bulkstat {
+	uint64_t	bs_ino;
+	uint64_t	bs_size;
+	uint64_t	bs_blocks;	/* filesystem blocks */
+	uint64_t	bs_xflags;
+	int64_t		bs_atime;
+	int64_t		bs_mtime;
+	int64_t		bs_ctime;
+	int64_t		bs_btime;
+	uint32_t	bs_gen;
+	uint32_t	bs_uid;
+	uint32_t	bs_gid;
+	uint32_t	bs_projectid;
+	uint32_t	bs_atime_nsec;
+	uint32_t	bs_mtime_nsec;
+	uint32_t	bs_ctime_nsec;
+	uint32_t	bs_btime_nsec;
+	uint32_t	bs_blksize;
+	uint32_t	bs_rdev;
+	uint32_t	bs_cowextsize_blks;
+	uint32_t	bs_extsize_blks;
+	uint32_t	bs_nlink;
+	uint32_t	bs_extents;
+	uint32_t	bs_aextents;
+	uint16_t	bs_version;
+	uint16_t	bs_forkoff;
+	uint16_t	bs_sick;
+	uint16_t	bs_checked;
+	uint16_t	bs_mode;
+	uint16_t	bs_pad2;
+	uint64_t	bs_extents64;
+	uint64_t	bs_pad[6];
+};
+
+struct xfs_bulk_ireq {
+	uint64_t	ino;
+	uint32_t	flags;
+	uint32_t	icount;
+	uint32_t	ocount;
+	uint32_t	agno;
+	uint64_t	reserved[5];
+};
+
+struct xfs_bulkstat_req {
+	struct xfs_bulk_ireq	hdr;
+	struct xfs_bulkstat	bulkstat[];
+};
+
+#define XFS_IOC_BULKSTAT	_IOR('X', 127, struct xfs_bulkstat_req)
+#endif
+
+#endif /* _CACHEFILESD_XFS_H */
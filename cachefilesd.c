@@ -31,9 +31,11 @@
 
 #define _GNU_SOURCE
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <signal.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -45,60 +47,183 @@
 #include <dirent.h>
 #include <time.h>
 #include <poll.h>
+#include <stdint.h>
+#include <sys/fanotify.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/vfs.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/magic.h>
+#include "cachefilesd-journal.h"
+#include "cachefilesd-culltable.h"
+#include "cachefilesd-objtree.h"
+#include "cachefilesd-reaper.h"
+#include "cachefilesd-xfs.h"
+
+static void discover_object(struct object_tree *tree, struct object *object);
+static void release_object(struct object_tree *tree, struct object *object);
+
+/* cache representation */
+static struct object_tree tree = OBJECT_TREE_INIT(discover_object,
+						  release_object);
+
+/* memory budget for the object tree
+ * - interior objects are only pinned by the cullable objects below them and
+ *   hold no directory stream once scanned (get_dir_fd() reopens the path on
+ *   demand), so the budget is kept by limiting how many objects the cull
+ *   tables may pin
+ */
+#define DIR_MEM_ESTIMATE	32768	/* cost of an open directory stream */
 
-typedef enum objtype {
-	OBJTYPE_INDEX,
-	OBJTYPE_DATA,
-	OBJTYPE_SPECIAL,
-	OBJTYPE_INTERMEDIATE,
-} objtype_t;
-
-struct object {
-	struct object	*parent;	/* parent dir of this object (or NULL) */
-	struct object	*children;	/* children of this object */
-	struct object	*next;		/* next child of parent */
-	struct object	*prev;		/* previous child of parent */
-	DIR		*dir;		/* this object's directory (or NULL for data obj) */
-	ino_t		ino;		/* inode number of this object */
-	int		usage;		/* number of users of this object */
-	char		empty;		/* T if directory empty */
-	char		new;		/* T if object new */
-	char		cullable;	/* T if object now cullable */
-	objtype_t	type;		/* type of object */
-	time_t		atime;		/* last access time on this object */
-	char		name[1];	/* name of this object */
-};
+static unsigned long long objmem_limit;	/* bytes; 0 for no limit */
 
-/* cache root representation */
-static struct object root = {
-	.parent		= NULL,
-	.usage		= 2,
-	.type		= OBJTYPE_INDEX,
+/* inode attributes harvested in inode order by XFS bulkstat at the start of a
+ * cold scan, looked up by the scanner instead of statting each entry
+ */
+#define BULKSTAT_BATCH		1024
+#define BULKSTAT_MAX		(1 << 22)	/* max inodes to remember */
+
+struct bulkstat_rec {
+	uint64_t	ino;		/* 0 if slot unused */
+	int64_t		atime;
+	int64_t		mtime;
+	uint64_t	blocks;
+	uint32_t	atime_nsec;
+	uint16_t	mode;
 };
 
-static int nobjects = 1;
-static int nopendir = 0;
+/* real-time access tracking
+ * - fanotify tells us when files on the cache filesystem are accessed so that
+ *   tracked objects can be pulled out of the cull tables without a rescan
+ * - data objects are hashed by inode number so that we can find them
+ */
+#define ACCESS_HASH_SIZE	65536
+
+static int fanotify_wanted;		/* T if access tracking requested */
+static int fanfd = -1;			/* fanotify fd or -1 */
+static int access_lost;			/* T if events were lost since the
+					 * last cold scan began */
+static int access_catchup;		/* T if this scan is catching up */
+static struct object *access_hash[ACCESS_HASH_SIZE];
+
+/* the times of recent accesses, so that the backing filesystem's atimes can
+ * be overridden if they're not being kept (relatime/noatime) */
+static struct access_time {
+	ino_t		ino;
+	long long	atime;		/* ns */
+} access_times[ACCESS_HASH_SIZE];
+
+/* objects recently found to be in use, keyed by parent and own inode number
+ * - we back off exponentially before asking about them again so that objects
+ *   pinned by long-lived opens aren't rechecked and offered for culling on
+ *   every scan
+ */
+#define BUSY_HASH_SIZE		4096
+#define BUSY_BACKOFF_MIN	(10 * 1000)		/* ms */
+#define BUSY_BACKOFF_MAX	(60 * 60 * 1000)	/* ms */
+
+static struct busy_object {
+	ino_t			parent;		/* inode of parent dir */
+	ino_t			ino;		/* 0 if slot unused */
+	unsigned		backoff;	/* ms */
+	unsigned long long	until;		/* time to check again (ms) */
+} busy_objects[BUSY_HASH_SIZE];
+
+/* ghosts of recently culled objects, keyed by parent inode number and name
+ * - a cache object that's recreated by FS-Cache soon after we culled it was
+ *   part of the working set, and the cull is counted as a regret
+ * - objects that keep being recreated may be ranked as younger than they are
+ *   so that they're culled later
+ */
+#define GHOST_HASH_SIZE		8192
+#define GHOST_TTL		(60 * 60)	/* s */
+#define GHOST_REGRETS_MAX	8
+
+static struct ghost {
+	ino_t		parent;		/* inode of parent dir */
+	uint32_t	namehash;	/* hash of object name */
+	unsigned char	regrets;	/* regrets of the culled object */
+	time_t		culled;		/* time of cull or 0 if slot unused */
+} ghosts[GHOST_HASH_SIZE];
+
+static unsigned ghostprotect;		/* s per regret; 0 to disable */
+
+/* binary journal of what the daemon does with each object, kept in a mapped
+ * ring of fixed-size records so that it's cheap enough to leave on (see
+ * cachefilesd-journal.h)
+ */
+#define JOURNAL_RECORDS_DEFAULT	65536
+
+static char *journal_path;		/* file to journal to or NULL */
+static unsigned journal_nrecords = JOURNAL_RECORDS_DEFAULT;
+static struct cfj_header *journal_hdr;	/* mapped journal or NULL */
+static struct cfj_record *journal_recs;
+
+static int nobulkstat;			/* T if bulkstat is disabled */
+static int use_bulkstat;		/* T if the cache is on XFS */
+static struct xfs_bulkstat_req *bulkstat_req;	/* harvest in progress */
+static struct bulkstat_rec *bulkstat_tab;
+static unsigned long bulkstat_mask, bulkstat_count;
+static unsigned long bulkstat_bsize;	/* fs block size; bs_blocks' unit */
 
 /* current scan point */
-static struct object *scan = &root;
+static struct object *scan = &tree.root;
+static struct object *scan_top = &tree.root;
 static int jumpstart_scan = 0;
 
+/* directories that turned up cull candidates last time they were scanned,
+ * most productive first
+ * - refills of the cull table rescan these (a hot scan) and only walk the
+ *   whole tree (a cold scan) every so often
+ */
+#define HOTDIRS_MAX		64
+#define COLD_SCAN_INTERVAL	(5 * 60 * 1000)	/* ms */
+
+static struct object *hotdirs[HOTDIRS_MAX];
+static int nhotdirs;
+static struct object *hotround[HOTDIRS_MAX];
+static int nhotround;
+static unsigned long long last_cold_scan;
+
 /* ranked order of cullable objects
  * - we have two tables: one we're building and one that's full of ready to be
  *   culled objects
  */
-static unsigned culltable_size = 4096;
-static struct object **cullbuild;
-static struct object **cullready;
-
-static int oldest_build = -1;
-static int oldest_ready = -1;
+#define CULLTABLE_DEFAULT	4096
+
+static unsigned culltable_size = CULLTABLE_DEFAULT;
+
+/* the cull tables may be allowed to grow and shrink between bounds with the
+ * demand for culling
+ * - they're grown if culling ran out of candidates or used up half a table
+ *   since we last looked
+ * - they're also grown if culling is steady but the scanner is having to look
+ *   at a lot of objects for each one culled, as a bigger table gets more
+ *   candidates out of each pass over the cache
+ * - they're shrunk if there's been little culling for a while
+ */
+#define ADAPT_INTERVAL		(60 * 1000)		/* ms */
+#define ADAPT_SHRINK_AFTER	(10 * 60 * 1000)	/* ms */
+#define ADAPT_SCAN_PER_CULL	64	/* objects scanned per cull to grow */
+
+static unsigned culltable_min = CULLTABLE_DEFAULT;
+static unsigned culltable_max = CULLTABLE_DEFAULT;
+static unsigned long long next_adapt, last_demand;	/* ms */
+static unsigned nculled_window, nstarved_window;
+static unsigned long long nscanned_mark;	/* nscanned at start of window */
+static char culltable_reason[80] = "configured";
+static struct cull_table cullbuild = CULL_TABLE_INIT;
+static struct cull_table cullready = CULL_TABLE_INIT;
 static int ncullable = 0;
 
+/* an index directory whose entire subtree is older than everything in a full
+ * build table may be offered for culling as a single object */
+static int dircull;
+
 
 static const char *configfile = "/etc/cachefilesd.conf";
 static const char *devfile = "/dev/cachefiles";
@@ -106,13 +231,242 @@ static const char *procfile = "/proc/fs/cachefiles";
 static const char *pidfile = "/var/run/cachefilesd.pid";
 static char *cacheroot, *graveyardpath;
 
-static int xdebug, xnolog, xopenedlog;
+static int xdebug, xnolog, xopenedlog, fast_start;
 static int stop, reap, cull, nocull; //, statecheck;
 static int graveyardfd;
 static unsigned long long brun, bcull, bstop, frun, fcull, fstop;
 
+/* the culling limits as percentages, as given to the kernel before the cache
+ * was bound; it only works out the thresholds from them when binding */
+enum {
+	LIMIT_BRUN, LIMIT_BCULL, LIMIT_BSTOP,
+	LIMIT_FRUN, LIMIT_FCULL, LIMIT_FSTOP,
+	NR_LIMITS
+};
+
+static const char *const limit_names[NR_LIMITS] = {
+	"brun", "bcull", "bstop", "frun", "fcull", "fstop",
+};
+
+static const unsigned limit_default[NR_LIMITS] = { 7, 5, 1, 7, 5, 1 };
+static unsigned limit_pct[NR_LIMITS] = { 7, 5, 1, 7, 5, 1 };
+
+/* the kernel expresses the block limits in units of the larger of the backing
+ * fs block size and the page size */
+static unsigned long long cache_bsize;
+
+/* space culled to the graveyard that the reaper hasn't yet given back */
+static unsigned long long pending_bytes, pending_files;
+
+#define CULL_BATCH_MAX	256
+
+/* the graveyard reaper */
+static int slice_expired(void);
+static void note_reaped(struct reaper *r, const char *name,
+			unsigned long long blocks, int isdir);
+
+static struct reaper reaper = REAPER_INIT(slice_expired, note_reaped);
+
+/* the main loop does scanning and reaping in time slices so that a request
+ * from the kernel to cull is serviced within cullwait ms
+ */
+#define CULLWAIT_DEFAULT	100
+
+static unsigned cullwait = CULLWAIT_DEFAULT;	/* ms */
+static unsigned long long slice_end;	/* end of current slice (ms) */
+static unsigned long long cull_raised;	/* when cull was set (ms) or 0 */
+static unsigned long long max_cull_latency;
+
+/* the kernel marks the cache fd readable when the state changes, but it only
+ * re-evaluates the culling state when asked, so whilst we're busy the state
+ * is reread at intervals and after each batch of culling */
+static int state_stale = 1;		/* T if state must be reread */
+static unsigned long long next_state_read;	/* ms */
+static char state_buffer[4096 + 1];	/* last state read */
+static int state_len;
+
+/* statistics, dumped to the log on SIGUSR1 */
+static int dump_stats_requested;
+static int reload_requested;		/* T if SIGHUP received */
+static int reloading;			/* T if rereading the config file */
+static unsigned long long start_time, time_to_bound, time_to_ready;	/* ms */
+static unsigned long long nstate_reads, nstate_parses;
+static unsigned long long nscanned, nstats, ninuse_checks, ncull_cmds;
+static unsigned long long nsubtree_culls, nbusy_hits, nbusy_culls;
+static unsigned long long nghost_culls, nregrets;
+
+/* predictive culling: the free space and free files are sampled periodically
+ * and a little culling is started ahead of time if the trend says we'll hit
+ * bcull/fcull within the horizon */
+#define PRECULL_NSAMPLES	12
+#define PRECULL_INTERVAL	5000	/* ms between samples */
+#define PRECULL_BATCH		8
+
+struct fill_sample {
+	unsigned long long	t;		/* time of sample (ms) */
+	unsigned long long	bavail;		/* free blocks (kernel units) */
+	unsigned long long	ffree;		/* free files */
+};
+
+static unsigned precull_horizon;	/* seconds; 0 to disable */
+static int precull;
+static struct fill_sample fill_samples[PRECULL_NSAMPLES];
+static int nfill_samples;
+static unsigned long long next_fill_sample;
+
+/* the scanner competes with FS-Cache for the disk, so it can be throttled by
+ * the IO pressure stall information for our cgroup (or the whole system)
+ * - a delay is put between scan slices that doubles each time the share of
+ *   time that tasks were stalled on IO is over the threshold and halves when
+ *   it's under half of it
+ * - scanning is paused whilst the stall is over twice the threshold
+ * - the throttle is lifted whilst culling is wanted and the ready table is
+ *   nearly empty
+ */
+#define PSI_INTERVAL		1000	/* ms between samples */
+#define SCAN_DELAY_MIN		10	/* ms */
+#define SCAN_DELAY_MAX		5000	/* ms */
+
+enum scan_throttle {
+	SCAN_FULL,
+	SCAN_SLOWED,
+	SCAN_PAUSED,
+};
+
+static const char *const scan_throttle_names[] = {
+	[SCAN_FULL]	= "full",
+	[SCAN_SLOWED]	= "slowed",
+	[SCAN_PAUSED]	= "paused",
+};
+
+static unsigned iothrottle;		/* stall % to slow at; 0 to disable */
+static int iothrottle_cgroup;		/* T to use our cgroup's stall */
+static int psifd = -1;			/* IO pressure file or -1 */
+static char psi_source[PATH_MAX];
+static unsigned long long psi_total, psi_time;	/* us */
+static unsigned long long next_psi_sample;	/* ms */
+static unsigned psi_stall;		/* tenths of a percent */
+static enum scan_throttle scan_throttle;
+static unsigned scan_delay;		/* ms between scan slices */
+static unsigned long long scan_resume;	/* ms */
+static int scan_urgent;			/* T if throttle lifted */
+static unsigned long long nscan_holds;
+
+/* parallel walking of a cache tree by several processes
+ * - the top of the tree is split into units of work, a directory each, that
+ *   the processes take in turn until there are none left
+ * - a unit either covers a whole subtree or, if its subdirectories have been
+ *   made into units of their own, just the directory's own files
+ * - the index volumes are found by their names rather than their depth, as
+ *   they sit below a level of fan-out directories in older caches
+ *   (cache/@xx/Iname) but directly in the cache directory in newer ones
+ *   (cache/Iname/@xx)
+ * - the levels below the index volumes are split if that's what it takes to
+ *   give each process several units
+ */
+#define WALKERS_MAX		256
+#define WALK_SPLIT_DEPTH	4
+
+struct walk_unit {
+	char		*path;		/* path relative to the cache root */
+	int		volume;		/* index of volume or -1 */
+	unsigned char	depth;		/* 0 for the cache dir itself */
+	char		shallow;	/* T if subdirs are units of their own */
+	char		grave;		/* T if a grave to be reaped */
+};
+
+static struct walk_unit *walk_units;
+static unsigned nwalk_units, maxwalk_units;
+static char **walk_volumes;		/* "[@xx/]Iname" of each index volume */
+static unsigned nwalk_volumes;
+
+/* offline analysis of a cache
+ * - times and sizes are binned by log2, bin N holding values less than 2^N
+ */
+#define ANALYSIS_BINS		48
+
+struct analysis_bin {
+	unsigned long long	files;
+	unsigned long long	blocks;
+};
+
+struct analysis {
+	unsigned long long	dirs;
+	unsigned long long	data_files;
+	unsigned long long	special_files;
+	unsigned long long	blocks;
+	unsigned long long	unexpected_names;
+	unsigned long long	unexpected_types;
+	struct analysis_bin	age[ANALYSIS_BINS];	/* seconds */
+	struct analysis_bin	size[ANALYSIS_BINS];	/* 512-byte blocks */
+};
+
+struct volume_totals {
+	unsigned long long	dirs;
+	unsigned long long	files;
+	unsigned long long	blocks;
+	unsigned long long	unexpected;
+	long long		newest_atime;
+};
+
+static struct analysis *analyses;	/* one per walker, shared */
+static struct volume_totals *volume_totals;	/* one per volume, shared */
+static time_t analysis_time;
+
+/* parallel sweep of the cache on startup
+ * - each walker removes unexpected objects, reaps graves and keeps the oldest
+ *   objects it finds in a heap, newest on top, with their paths in a buffer
+ *   of names
+ * - the paths of displaced candidates are squeezed out of the buffer when it
+ *   fills up, provided that gets back a good part of it
+ * - each walker's heap holds an even share of the cull table, and its heap
+ *   and buffer come out of an even share of the object memory budget, if
+ *   there is one
+ * - the walkers' heaps are merged to fill the cull table
+ */
+#define SWEEP_NAME_BUDGET	256	/* bytes of names per candidate */
+#define SWEEP_MIN_CANDIDATES	64	/* per walker, whatever the budget */
+
+struct sweep_candidate {
+	long long	atime;		/* ns */
+	ino_t		ino;
+	unsigned	path;		/* offset of path in names buffer */
+	unsigned	walker;		/* walker whose names buffer it's in */
+};
+
+struct sweep {
+	unsigned long long	dirs;
+	unsigned long long	files;
+	unsigned long long	unexpected;	/* objects removed or buried */
+	unsigned long long	graves;		/* graves reaped */
+	unsigned long long	dropped;	/* candidates with no room for path */
+	struct sweep_candidate	*candidates;	/* heap, newest on top */
+	char			*names;
+	unsigned		ncandidates;
+	unsigned		namesize;	/* amount of names[] used */
+	unsigned		namelive;	/* amount used by candidates */
+};
+
+static unsigned sweep_jobs;		/* walkers to sweep with; 0 for none */
+static struct sweep *sweeps;		/* one per walker, shared */
+static unsigned sweep_max;		/* candidates per walker */
+static size_t sweep_names_max;		/* size of each walker's names[] */
+
 #define cachefd 3
 
+/* each cache needs its own cache fd, so if the config file describes several
+ * caches, a supervisor process forks a daemon for each
+ * - each daemon has its own object tree, cull tables and graveyard
+ * - each 'dir' command starts a new cache; commands before the first 'dir'
+ *   apply to all of them
+ */
+#define CACHES_MAX	64
+
+static int cache_index = -1;		/* cache this daemon handles, or -1 */
+static int ready_fd = -1;		/* fd to tell the supervisor we're bound */
+static pid_t cache_pids[CACHES_MAX];	/* daemons being supervised */
+static int ncache_pids;
+
 static __attribute__((noreturn))
 void version(void)
 {
@@ -125,14 +479,18 @@ void help(void)
 {
 	fprintf(stderr,
 		"Format:\n"
-		"  /sbin/cachefilesd [-d]* [-s] [-n] [-p <pidfile>] [-f <configfile>]\n"
+		"  /sbin/cachefilesd [-d]* [-s] [-n] [-F] [-p <pidfile>] [-f <configfile>]\n"
 		"  /sbin/cachefilesd -v\n"
+		"  /sbin/cachefilesd -a <cachedir> [-j <jobs>]\n"
 		"\n"
 		"Options:\n"
 		"  -d\tIncrease debugging level (cumulative)\n"
 		"  -n\tDon't daemonise the process\n"
+		"  -F\tFast start: only sync the cache filesystem\n"
 		"  -s\tMessage output to stderr instead of syslog\n"
 		"  -p <pidfile>\tWrite the PID into the file\n"
+		"  -a <cachedir>\tAnalyse the cache and print JSON, read-only\n"
+		"  -j <jobs>\tNumber of processes to analyse with\n"
 		"  -f <configfile>\n"
 		"  -v\tPrint version and exit\n"
 		"\tRead the specified configuration file instead of"
@@ -203,21 +561,68 @@ void __message(int dlevel, int level, const char *fmt, ...)
 #define notice(FMT,...)		__message(0,  LOG_NOTICE, FMT"\n" ,##__VA_ARGS__)
 
 static void open_cache(void);
+static void reload_config(void);
+static int limit_index(const char *cp);
+static void note_limit(int limit, const char *cp);
+static int count_caches(void);
+static void manage_caches(int ncaches, int nodaemon);
+static void sync_cache_fs(void);
+static void close_fds_from(int from, int open_max);
 static void cachefilesd(void) __attribute__((noreturn));
 static void reap_graveyard(void);
-static void reap_graveyard_aux(const char *dirname);
+static enum reap_pressure cache_pressure(void);
+static void read_fs_free(unsigned long long *_bavail, unsigned long long *_ffree);
 static void read_cache_state(void);
 static int is_object_in_use(const char *filename);
-static void cull_file(const char *filename);
+static int recently_busy(struct object *object);
+static void note_busy(struct object *object, int busy);
+static int cull_file(const char *filename);
+static void note_ghost(struct object *object);
+static void open_journal(void);
+static inline struct cull_key cull_key(struct object *object);
+static struct cfj_record *journal_slot(enum cfj_event event);
+static void journal_event(enum cfj_event event, struct object *object,
+			  unsigned aux);
+static void check_ghost(struct object *object);
 static void build_cull_table(void);
 static void decant_cull_table(void);
-static void insert_into_cull_table(struct object *object);
+static int insert_into_cull_table(struct object *object);
+static void start_scan(int cold);
+static void update_hotdirs(struct object *dir);
 static void put_object(struct object *object);
+static int build_table_full(void);
 static struct object *create_object(struct object *parent, const char *name, struct stat64 *st);
-static void destroy_unexpected_object(struct object *parent, struct dirent *de);
+static void destroy_unexpected_object(int fd, const char *name,
+				      unsigned char type);
 static int get_dir_fd(struct object *dir);
-static void cull_object(struct object *object);
-static void cull_objects(void);
+static int cull_object(struct object *object, unsigned long long *_bytes);
+static int cull_subtree(struct object *dir, unsigned long long *_bytes);
+static void reset_subtree(struct object *dir);
+static void add_to_subtree(struct object *dir, long long atime, blkcnt64_t blocks,
+			   unsigned files, int busy);
+static void consider_subtree_cull(struct object *dir);
+static void cull_objects(int max);
+static void start_bulkstat(void);
+static int harvest_bulkstat(void);
+static void open_access_tracking(void);
+static void reopen_access_tracking(void);
+static void close_access_tracking(void);
+static void read_access_events(void);
+static void hash_object(struct object *object);
+static void unhash_object(struct object *object);
+static void apply_access_time(struct stat64 *st);
+static int open_walk_dir(int dirfd, const char *name);
+static void discard_bulkstat(void);
+static void sample_fill_rate(void);
+static void open_io_pressure(void);
+static void reopen_io_pressure(void);
+static int scan_held(void);
+static int unexpected_name(const char *name);
+static int unexpected_type(const char *name, mode_t mode);
+static void analyse_cache(const char *dir, unsigned jobs)
+	__attribute__((noreturn));
+static void sweep_cache(unsigned jobs);
+static void dump_stats(void);
 
 /*****************************************************************************/
 /*
@@ -246,6 +651,512 @@ static void sigalrm(int sig)
 	jumpstart_scan = 1;
 }
 
+/*****************************************************************************/
+/*
+ * configuration reload requested
+ */
+static void sighup(int sig)
+{
+	reload_requested = 1;
+}
+
+/*****************************************************************************/
+/*
+ * statistics dump requested
+ */
+static void sigusr1(int sig)
+{
+	dump_stats_requested = 1;
+}
+
+/*****************************************************************************/
+/*
+ * get the current time in milliseconds from the monotonic clock
+ */
+static unsigned long long now_msec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		oserror("Unable to read the clock");
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*****************************************************************************/
+/*
+ * get the current time in microseconds from the monotonic clock
+ */
+static unsigned long long now_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		oserror("Unable to read the clock");
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*****************************************************************************/
+/*
+ * get the current time in nanoseconds from the real time clock, to compare
+ * with file timestamps
+ */
+static long long now_nsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		oserror("Unable to read the clock");
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*****************************************************************************/
+/*
+ * start a slice of scanning or reaping work
+ * - half the permitted cull latency is allowed as the other half may be spent
+ *   on whatever else was in progress
+ */
+static void start_slice(void)
+{
+	slice_end = now_msec() + (cullwait / 2 ?: 1);
+}
+
+/*****************************************************************************/
+/*
+ * see if the current slice of work has run out of time
+ */
+static int slice_expired(void)
+{
+	return now_msec() >= slice_end;
+}
+
+/*****************************************************************************/
+/*
+ * note the time from the kernel asking for culling to us culling something
+ */
+static void note_cull_latency(void)
+{
+	unsigned long long latency;
+
+	if (!cull_raised)
+		return;
+
+	latency = now_msec() - cull_raised;
+	cull_raised = 0;
+
+	if (latency > max_cull_latency)
+		max_cull_latency = latency;
+
+	debug(1, "Cull latency %llums (max %llums)", latency, max_cull_latency);
+	if (latency > cullwait)
+		notice("Cull latency %llums exceeded %ums", latency, cullwait);
+}
+
+/*****************************************************************************/
+/*
+ * log the statistics
+ */
+static void dump_stats(void)
+{
+	char buf[REAP_HIST_SIZE * 48 + 1], *p;
+	int loop;
+
+	notice("Stats: scanned=%llu stat=%llu inuse=%llu cull=%llu subtrees=%llu",
+	       nscanned, nstats, ninuse_checks, ncull_cmds, nsubtree_culls);
+	notice("Stats: busy cache hits=%llu, culls wasted on EBUSY=%llu",
+	       nbusy_hits, nbusy_culls);
+	notice("Stats: culls=%llu regretted=%llu (%llu.%llu%%)",
+	       nghost_culls, nregrets,
+	       nghost_culls ? nregrets * 100 / nghost_culls : 0,
+	       nghost_culls ? nregrets * 1000 / nghost_culls % 10 : 0);
+	notice("Stats: state reads=%llu parses=%llu (%llu per 1000 scanned)",
+	       nstate_reads, nstate_parses,
+	       nscanned ? nstate_reads * 1000 / nscanned : 0);
+	notice("Stats: objects=%d objmem=%llu max cull latency=%llums",
+	       tree.nobjects, tree.objmem, max_cull_latency);
+	notice("Stats: bound after %llums, ready after %llums",
+	       time_to_bound, time_to_ready);
+	notice("Stats: cull table size=%u [%u-%u] (%s)",
+	       culltable_size, culltable_min, culltable_max, culltable_reason);
+	if (iothrottle && psifd >= 0)
+		notice("Stats: scan %s%s delay=%ums io stall=%u.%u%% holds=%llu (%s)",
+		       scan_throttle_names[scan_throttle],
+		       scan_urgent ? " (lifted)" : "",
+		       scan_delay, psi_stall / 10, psi_stall % 10,
+		       nscan_holds, psi_source);
+	else
+		notice("Stats: scan not throttled");
+
+	/* reaping latencies as "<upper bound in us>:<count>" */
+	p = buf;
+	for (loop = 0; loop < REAP_HIST_SIZE; loop++)
+		if (reaper.latency_hist[loop])
+			p += sprintf(p, " %llu:%llu", 2ULL << loop,
+				     reaper.latency_hist[loop]);
+	notice("Stats: reap latency (us):%s", p == buf ? " none" : buf);
+}
+
+/*****************************************************************************/
+/*
+ * pass a signal on to the daemons we're supervising
+ */
+static void sigrelay(int sig)
+{
+	int loop;
+
+	for (loop = 0; loop < CACHES_MAX; loop++)
+		if (cache_pids[loop] > 0)
+			kill(cache_pids[loop], sig);
+}
+
+/*****************************************************************************/
+/*
+ * report a problem with the config file
+ * - at startup this is fatal, but if we're reloading, the reload is just
+ *   abandoned and the daemon carries on as it was
+ */
+static __attribute__((format(printf, 2, 3)))
+int option_error(unsigned lineno, const char *fmt, ...)
+{
+	char buf[256];
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+
+	if (!reloading)
+		cfgerror("%s", buf);
+
+	notice("%s:%d:%s (not reloaded)", configfile, lineno, buf);
+	return -1;
+}
+
+/*****************************************************************************/
+/*
+ * read the next command from the config file that applies to this daemon
+ * - blank lines, leading white space and comments are eaten
+ * - with several caches, each daemon only handles the commands common to all
+ *   of them and those in its own cache's block
+ * - returns 1 with *_cp pointing to the command, 0 at EOF and -1 on error
+ */
+static int read_config_line(FILE *config, char **_line, size_t *_m,
+			    unsigned *_lineno, int *_block, char **_cp)
+{
+	ssize_t n;
+	char *cp;
+
+	while (n = getline(_line, _m, config),
+	       n != EOF
+	       ) {
+		(*_lineno)++;
+
+		if (n >= sysconf(_SC_PAGESIZE))
+			return option_error(*_lineno, "Line too long");
+
+		if (memchr(*_line, 0, n) != 0)
+			return option_error(*_lineno,
+					    "Line contains a NUL character");
+
+		/* eat blank lines, leading white space and trailing NL */
+		cp = strchr(*_line, '\n');
+		if (!cp)
+			return option_error(*_lineno, "Unterminated line");
+
+		if (cp == *_line)
+			continue;
+		*cp = '\0';
+
+		for (cp = *_line; isspace(*cp); cp++) {;}
+
+		if (!*cp)
+			continue;
+
+		/* eat full line comments */
+		if (*cp == '#')
+			continue;
+
+		if (memcmp(cp, "dir", 3) == 0 && isspace(cp[3]))
+			(*_block)++;
+		if (cache_index >= 0 && *_block != 0 &&
+		    *_block != cache_index + 1)
+			continue;
+
+		*_cp = cp;
+		return 1;
+	}
+
+	if (!feof(config))
+		return option_error(*_lineno, "Unable to read: %m");
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * parse a number argument to a config command
+ * - returns -1 if it's not a number
+ */
+static long parse_number(const char *cp, int cmdlen)
+{
+	unsigned long n;
+	char *sp;
+
+	for (sp = (char *)cp + cmdlen; isspace(*sp); sp++) {;}
+
+	if (!isdigit(*sp))
+		return -1;
+	n = strtoul(sp, &sp, 10);
+	if (*sp || n > LONG_MAX)
+		return -1;
+	return n;
+}
+
+/*****************************************************************************/
+/*
+ * handle the config commands that concern the daemon rather than the kernel
+ * - the setting is only changed if apply is true, so the config file can be
+ *   checked first
+ * - returns 1 if the command was handled, 0 if it should go to the kernel and
+ *   -1 if there's an error
+ */
+static int parse_daemon_option(const char *cp, unsigned lineno, int apply)
+{
+	long n;
+
+#define CMD(name) \
+	(memcmp(cp, name, sizeof(name) - 1) == 0 && \
+	 (!cp[sizeof(name) - 1] || isspace(cp[sizeof(name) - 1])))
+
+	/* allow culling to be disabled */
+	if (CMD("nocull")) {
+		if (apply)
+			nocull = 1;
+		return 0;
+	}
+
+	/* note the cull table size command
+	 * - a second size permits the table to adapt between the two */
+	if (CMD("culltable")) {
+		unsigned long max;
+		char *sp;
+
+		for (sp = (char *)cp + 9; isspace(*sp); sp++) {;}
+		if (!isdigit(*sp))
+			return option_error(lineno, "Invalid cull table size number");
+		n = max = strtoul(sp, &sp, 10);
+
+		for (; isspace(*sp); sp++) {;}
+		if (*sp) {
+			if (!isdigit(*sp))
+				return option_error(lineno, "Invalid cull table size number");
+			max = strtoul(sp, &sp, 10);
+			if (*sp)
+				return option_error(lineno, "Invalid cull table size number");
+		}
+
+		if (n < 12 || n > 20 || max < 12 || max > 20)
+			return option_error(lineno, "Log2 of cull table size must be 12 <= N <= 20");
+		if (max < n)
+			return option_error(lineno, "Maximum cull table size is less than minimum");
+		if (apply) {
+			culltable_size = culltable_min = 1 << n;
+			culltable_max = 1 << max;
+		}
+		return 1;
+	}
+
+	/* note the permitted cull latency */
+	if (CMD("cullwait")) {
+		n = parse_number(cp, 8);
+		if (n < 2)
+			return option_error(lineno, "Invalid cull latency");
+		if (apply)
+			cullwait = n;
+		return 1;
+	}
+
+	/* note the size above which graves are truncated in steps */
+	if (CMD("reaptrunc")) {
+		n = parse_number(cp, 9);
+		if (n < 0)
+			return option_error(lineno, "Invalid reap truncation threshold");
+		if (apply)
+			reaper.trunc_threshold = n * 1024ULL * 1024ULL;
+		return 1;
+	}
+
+	/* note the step by which big graves are truncated */
+	if (CMD("reapstep")) {
+		n = parse_number(cp, 8);
+		if (n <= 0)
+			return option_error(lineno, "Invalid reap truncation step");
+		if (apply)
+			reaper.trunc_step = n * 1024ULL * 1024ULL;
+		return 1;
+	}
+
+	/* note the predictive culling horizon */
+	if (CMD("precull")) {
+		n = parse_number(cp, 7);
+		if (n < 0)
+			return option_error(lineno, "Invalid precull horizon");
+		if (apply)
+			precull_horizon = n;
+		return 1;
+	}
+
+	/* note how much younger to rank objects that keep being recreated */
+	if (CMD("ghostprotect")) {
+		n = parse_number(cp, 12);
+		if (n < 0)
+			return option_error(lineno, "Invalid ghost protection time");
+		if (apply)
+			ghostprotect = n;
+		return 1;
+	}
+
+	/* note where to journal to
+	 * - the journal is set up before the cache is bound, so changes to it
+	 *   take effect when the daemon is restarted
+	 */
+	if (CMD("journal")) {
+		unsigned long nrecords = JOURNAL_RECORDS_DEFAULT;
+		char *sp, *ep;
+		size_t len;
+
+		for (sp = (char *)cp + 7; isspace(*sp); sp++) {;}
+		for (ep = sp; *ep && !isspace(*ep); ep++) {;}
+		len = ep - sp;
+		if (len == 0 || len > PATH_MAX - 10)
+			return option_error(lineno, "Invalid journal filename");
+
+		for (; isspace(*ep); ep++) {;}
+		if (*ep) {
+			if (!isdigit(*ep))
+				return option_error(lineno, "Invalid journal size");
+			nrecords = strtoul(ep, &ep, 10);
+			if (*ep || nrecords < 1024 || nrecords > (1 << 24))
+				return option_error(lineno, "Journal size must be 1024 <= N <= 16777216 records");
+		}
+
+		if (apply && !reloading) {
+			free(journal_path);
+			journal_path = strndup(sp, len);
+			if (!journal_path)
+				oserror("Can't copy journal name");
+			journal_nrecords = nrecords;
+		}
+		return 1;
+	}
+
+	/* note if the cache should be swept in parallel on startup
+	 * - with no number, a walker is used per CPU
+	 */
+	if (CMD("sweep")) {
+		char *sp;
+
+		for (sp = (char *)cp + 5; isspace(*sp); sp++) {;}
+		if (*sp) {
+			n = parse_number(cp, 5);
+			if (n < 1 || n > WALKERS_MAX)
+				return option_error(lineno, "Sweep jobs must be 1 <= N <= %d", WALKERS_MAX);
+		} else {
+			n = sysconf(_SC_NPROCESSORS_ONLN);
+			if (n < 1)
+				n = 1;
+			if (n > WALKERS_MAX)
+				n = WALKERS_MAX;
+		}
+		if (apply)
+			sweep_jobs = n;
+		return 1;
+	}
+
+	/* note the IO stall at which to throttle the scanner and whether the
+	 * stall should be that of our own cgroup rather than the system's */
+	if (CMD("iothrottle")) {
+		int cgroup = 0;
+		char *sp;
+
+		for (sp = (char *)cp + 10; isspace(*sp); sp++) {;}
+		if (!isdigit(*sp))
+			return option_error(lineno, "Invalid IO throttle");
+		n = strtoul(sp, &sp, 10);
+
+		for (; isspace(*sp); sp++) {;}
+		if (*sp) {
+			if (strcmp(sp, "cgroup") != 0)
+				return option_error(lineno, "Invalid IO throttle");
+			cgroup = 1;
+		}
+
+		if (n < 0 || n > 50)
+			return option_error(lineno, "IO throttle must be 0 <= N <= 50 percent");
+		if (apply) {
+			iothrottle = n;
+			iothrottle_cgroup = cgroup;
+		}
+		return 1;
+	}
+
+	/* note if real-time access tracking is wanted */
+	if (CMD("fanotify")) {
+		if (apply)
+			fanotify_wanted = 1;
+		return 1;
+	}
+
+	/* note if whole cold subtrees may be culled */
+	if (CMD("dircull")) {
+		if (apply)
+			dircull = 1;
+		return 1;
+	}
+
+	/* allow the XFS bulkstat scanner to be disabled */
+	if (CMD("nobulkstat")) {
+		if (apply)
+			nobulkstat = 1;
+		return 1;
+	}
+
+	/* note the object tree memory budget */
+	if (CMD("objmem")) {
+		n = parse_number(cp, 6);
+		if (n < 0)
+			return option_error(lineno, "Invalid object memory budget");
+		if (apply)
+			objmem_limit = n * 1024ULL * 1024ULL;
+		return 1;
+	}
+
+#undef CMD
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * put the daemon's settings back to their defaults before rereading the
+ * config file
+ */
+static void reset_daemon_options(void)
+{
+	nocull = 0;
+	culltable_size = CULLTABLE_DEFAULT;
+	culltable_min = CULLTABLE_DEFAULT;
+	culltable_max = CULLTABLE_DEFAULT;
+	cullwait = CULLWAIT_DEFAULT;
+	reaper.trunc_threshold = REAP_TRUNC_THRESHOLD_DEFAULT;
+	reaper.trunc_step = REAP_TRUNC_STEP_DEFAULT;
+	precull_horizon = 0;
+	iothrottle = 0;
+	iothrottle_cgroup = 0;
+	ghostprotect = 0;
+	fanotify_wanted = 0;
+	dircull = 0;
+	nobulkstat = 0;
+	objmem_limit = 0;
+}
+
 /*****************************************************************************/
 /*
  * write the PID file
@@ -271,12 +1182,16 @@ int main(int argc, char *argv[])
 {
 	struct stat st;
 	unsigned lineno;
-	ssize_t n;
 	size_t m;
 	FILE *config;
 	char *line, *cp;
 	long page_size;
-	int _cachefd, nullfd, opt, loop, open_max, nodaemon = 0;
+	int _cachefd, nullfd, opt, open_max, nodaemon = 0, ncaches, block = 0;
+	const char *analyse = NULL;
+	long jobs = 0;
+	char *ep;
+
+	start_time = now_msec();
 
 	/* handle help request */
 	if (argc == 2 && strcmp(argv[1], "--help") == 0)
@@ -286,7 +1201,7 @@ int main(int argc, char *argv[])
 		version();
 
 	/* parse the arguments */
-	while (opt = getopt(argc, argv, "dsnf:p:v"),
+	while (opt = getopt(argc, argv, "dsnFf:p:va:j:"),
 	       opt != EOF
 	       ) {
 		switch (opt) {
@@ -305,6 +1220,11 @@ int main(int argc, char *argv[])
 			nodaemon = 1;
 			break;
 
+		case 'F':
+			/* only sync the cache filesystem */
+			fast_start = 1;
+			break;
+
 		case 'f':
 			/* use a specific config file */
 			configfile = optarg;
@@ -319,11 +1239,34 @@ int main(int argc, char *argv[])
 			/* print the version and exit */
 			version();
 
+		case 'a':
+			/* analyse a cache without binding it */
+			analyse = optarg;
+			break;
+
+		case 'j':
+			/* number of processes to analyse with */
+			jobs = strtol(optarg, &ep, 10);
+			if (*ep || jobs < 1 || jobs > WALKERS_MAX)
+				opterror("Invalid number of jobs");
+			break;
+
 		default:
 			opterror("Unknown commandline option '%c'", optopt);
 		}
 	}
 
+	if (analyse) {
+		xnolog = 1;
+		if (!jobs)
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs < 1)
+			jobs = 1;
+		if (jobs > WALKERS_MAX)
+			jobs = WALKERS_MAX;
+		analyse_cache(analyse, jobs);
+	}
+
 	/* read various parameters */
 	page_size = sysconf(_SC_PAGESIZE);
 	if (page_size < 0)
@@ -340,8 +1283,15 @@ int main(int argc, char *argv[])
 	if (setresgid(0, 0, 0) < 0)
 		oserror("Unable to set GID to 0");
 
-	/* just in case... */
-	sync();
+	/* just in case... (a fast start only syncs the cache filesystem, once
+	 * we know where it is) */
+	if (!fast_start)
+		sync();
+
+	/* fork a daemon for each cache if there's more than one */
+	ncaches = count_caches();
+	if (ncaches > 1)
+		manage_caches(ncaches, nodaemon);
 
 	/* open the devfile or the procfile on fd 3 */
 	_cachefd = open(devfile, O_RDWR);
@@ -378,65 +1328,19 @@ int main(int argc, char *argv[])
 	m = 0;
 	line = NULL;
 	lineno = 0;
-	while (n = getline(&line, &m, config),
-	       n != EOF
-	       ) {
-		lineno++;
-
-		if (n >= page_size)
-			cfgerror("Line too long");
+	while (read_config_line(config, &line, &m, &lineno, &block, &cp) > 0) {
+		/* note the options that the daemon handles */
+		if (parse_daemon_option(cp, lineno, 1))
+			continue;
 
-		if (memchr(line, 0, n) != 0)
-			cfgerror("Line contains a NUL character");
+		/* note the dir command */
+		if (memcmp(cp, "dir", 3) == 0 && isspace(cp[3])) {
+			char *sp;
 
-		/* eat blank lines, leading white space and trailing NL */
-		cp = strchr(line, '\n');
-		if (!cp)
-			cfgerror("Unterminated line");
+			for (sp = cp + 4; isspace(*sp); sp++) {;}
 
-		if (cp == line)
-			continue;
-		*cp = '\0';
-
-		for (cp = line; isspace(*cp); cp++) {;}
-
-		if (!*cp)
-			continue;
-
-		/* eat full line comments */
-		if (*cp == '#')
-			continue;
-
-		/*  allow culling to be disabled */
-		if (memcmp(cp, "nocull", 6) == 0 &&
-		    (!cp[6] || isspace(cp[6]))) {
-			nocull = 1;
-		}
-
-		/* note the cull table size command */
-		if (memcmp(cp, "culltable", 9) == 0 && isspace(cp[9])) {
-			unsigned long cts;
-			char *sp;
-
-			for (sp = cp + 10; isspace(*sp); sp++) {;}
-
-			cts = strtoul(sp, &sp, 10);
-			if (*sp)
-				cfgerror("Invalid cull table size number");
-			if (cts < 12 || cts > 20)
-				cfgerror("Log2 of cull table size must be 12 <= N <= 20");
-			culltable_size = 1 << cts;
-			continue;
-		}
-
-		/* note the dir command */
-		if (memcmp(cp, "dir", 3) == 0 && isspace(cp[3])) {
-			char *sp;
-
-			for (sp = cp + 4; isspace(*sp); sp++) {;}
-
-			if (strlen(sp) > PATH_MAX - 10)
-				cfgerror("Cache pathname is too long");
+			if (strlen(sp) > PATH_MAX - 10)
+				cfgerror("Cache pathname is too long");
 
 			if (stat(sp, &st) < 0)
 				oserror("Can't confirm cache location");
@@ -452,11 +1356,12 @@ int main(int argc, char *argv[])
 			cfgerror("'bind' command not permitted");
 
 		/* pass the config options over to the kernel module */
-		if (write(cachefd, line, strlen(line)) < 0) {
+		if (write(cachefd, cp, strlen(cp)) < 0) {
 			if (errno == -ENOMEM || errno == -EIO)
 				oserror("CacheFiles");
 			cfgerror("CacheFiles gave config error: %m");
 		}
+		note_limit(limit_index(cp), cp);
 	}
 
 	if (line)
@@ -468,15 +1373,14 @@ int main(int argc, char *argv[])
 	if (fclose(config) == EOF)
 		oserror("Unable to close %s", configfile);
 
+	if (fast_start)
+		sync_cache_fs();
+
 	/* allocate the cull tables */
 	if (!nocull) {
-		cullbuild = calloc(culltable_size, sizeof(cullbuild[0]));
-		if (!cullbuild)
-			oserror("calloc");
-
-		cullready = calloc(culltable_size, sizeof(cullready[0]));
-		if (!cullready)
-			oserror("calloc");
+		if (cull_table_resize(&cullbuild, culltable_size, NULL) < 0 ||
+		    cull_table_resize(&cullready, culltable_size, NULL) < 0)
+			oserror("Unable to allocate cull tables");
 	}
 
 	/* leave stdin, stdout, stderr and cachefd open only */
@@ -485,8 +1389,12 @@ int main(int argc, char *argv[])
 	if (nullfd != 1)
 		dup2(nullfd, 1);
 
-	for (loop = 4; loop < open_max; loop++)
-		close(loop);
+	close_fds_from(ready_fd >= 0 ? ready_fd + 1 : 4, open_max);
+
+	/* map the journal and find the IO pressure whilst we can still see the
+	 * filesystem */
+	open_journal();
+	open_io_pressure();
 
 	/* set up a connection to syslog whilst we still can (the bind command
 	 * will give us our own namespace with no /dev/log */
@@ -498,10 +1406,25 @@ int main(int argc, char *argv[])
 	if (write(cachefd, "bind", 4) < 0)
 		oserror("CacheFiles bind failed");
 
-	info("Bound cache");
+	time_to_bound = now_msec() - start_time;
+	info("Bound cache (%llums after start)", time_to_bound);
 
-	/* we now have a live cache - daemonise the process */
-	if (!nodaemon) {
+	/* tell the supervisor, if there is one */
+	if (ready_fd >= 0) {
+		if (write(ready_fd, "b", 1) < 0)
+			oserror("Unable to report cache bound");
+		close(ready_fd);
+		ready_fd = -1;
+	}
+
+	/* we now have a live cache - daemonise the process, unless the
+	 * supervisor has already done that */
+	if (cache_index >= 0) {
+		if (!nodaemon && !xdebug)
+			dup2(1, 2);
+		cachefilesd();
+	}
+	else if (!nodaemon) {
 		if (!xdebug)
 			dup2(1, 2);
 
@@ -533,971 +1456,3659 @@ int main(int argc, char *argv[])
 
 /*****************************************************************************/
 /*
- * open the cache directories
+ * flush the filesystem holding the cache rather than every filesystem on the
+ * system
  */
-static void open_cache(void)
+static void sync_cache_fs(void)
 {
-	struct statfs sfs;
-	char buffer[PATH_MAX + 1];
+	int fd;
 
-	/* open the cache directory so we can scan it */
-	snprintf(buffer, PATH_MAX, "%s/cache", cacheroot);
+	if (!cacheroot) {
+		sync();
+		return;
+	}
 
-	root.dir = opendir(buffer);
-	if (!root.dir)
+	fd = open(cacheroot, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
 		oserror("Unable to open cache directory");
-	nopendir++;
-
-	/* open the graveyard so we can set a notification on it */
-	if (asprintf(&graveyardpath, "%s/graveyard", cacheroot) < 0)
-		oserror("Unable to copy graveyard name");
-
-	graveyardfd = open(graveyardpath, O_DIRECTORY);
-	if (graveyardfd < 0)
-		oserror("Unable to open graveyard directory");
 
-	if (fstatfs(graveyardfd, &sfs) < 0)
-		oserror("Unable to stat cache filesystem");
+	if (syncfs(fd) < 0) {
+		if (errno != ENOSYS)
+			oserror("Unable to sync cache filesystem");
+		sync();
+	}
 
-	if (sfs.f_bsize == -1 ||
-	    sfs.f_blocks == -1 ||
-	    sfs.f_bfree == -1 ||
-	    sfs.f_bavail == -1)
-		error("Backing filesystem returns unusable statistics through fstatfs()");
+	close(fd);
 }
 
 /*****************************************************************************/
 /*
- * manage the cache
+ * create and map the journal, if one was asked for
+ * - the previous journal is kept as <name>.old so that a restart after a
+ *   crash doesn't wipe out the record of what led up to it
+ * - when managing several caches, each daemon journals to <name>.<N>, where N
+ *   is the cache's position in the config file, counting from 1
  */
-static void cachefilesd(void)
+static void open_journal(void)
 {
-	sigset_t sigs, osigs;
-
-	struct pollfd pollfds[1] = {
-		[0] = {
-			.fd	= cachefd,
-			.events	= POLLIN,
-		},
-	};
-
-	notice("Daemon Started");
-
-	/* open the cache directories */
-	open_cache();
-
-	/* we need to disable I/O and termination signals so they're only
-	 * caught at appropriate times
-	 */
-	sigemptyset(&sigs);
-	sigaddset(&sigs, SIGIO);
-	sigaddset(&sigs, SIGINT);
-	sigaddset(&sigs, SIGTERM);
+	struct timeval tv;
+	char path[PATH_MAX - 4], old[PATH_MAX];
+	size_t size;
+	void *map;
+	int fd;
 
-	signal(SIGTERM, sigterm);
-	signal(SIGINT, sigterm);
+	if (!journal_path)
+		return;
 
-	/* check the graveyard for graves */
-	reap_graveyard();
+	if (cache_index >= 0)
+		snprintf(path, sizeof(path), "%s.%d",
+			 journal_path, cache_index + 1);
+	else
+		snprintf(path, sizeof(path), "%s", journal_path);
+
+	snprintf(old, sizeof(old), "%s.old", path);
+	if (rename(path, old) < 0 && errno != ENOENT)
+		oserror("Unable to keep old journal %s", path);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+	if (fd < 0)
+		oserror("Unable to create journal %s", path);
+
+	size = CFJ_HEADER_SIZE +
+		(size_t) journal_nrecords * sizeof(struct cfj_record);
+	if (ftruncate(fd, size) < 0)
+		oserror("Unable to size journal %s", path);
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		oserror("Unable to map journal %s", path);
+	close(fd);
+
+	gettimeofday(&tv, NULL);
+
+	journal_hdr = map;
+	journal_recs = map + CFJ_HEADER_SIZE;
+	journal_hdr->version = CFJ_VERSION;
+	journal_hdr->record_size = sizeof(struct cfj_record);
+	journal_hdr->nrecords = journal_nrecords;
+	journal_hdr->head = 0;
+	journal_hdr->start_usec = tv.tv_sec * 1000000ULL + tv.tv_usec -
+		(now_usec() - start_time * 1000);
+	journal_hdr->pid = getpid();
+	if (cacheroot)
+		strncpy(journal_hdr->cacheroot, cacheroot,
+			sizeof(journal_hdr->cacheroot) - 1);
+	journal_hdr->magic = CFJ_MAGIC;
+}
 
-	while (!stop) {
-		read_cache_state();
+/*****************************************************************************/
+/*
+ * get the next record in the journal ring and fill in the common parts
+ * - the record is filled in in place, so a reader may see it half written;
+ *   the slot is marked busy first and only given its sequence number by
+ *   journal_commit(), so a reader that checks the sequence number both before
+ *   and after copying the record can tell
+ */
+static struct cfj_record *journal_slot(enum cfj_event event)
+{
+	struct cfj_record *rec;
+	uint64_t seq = journal_hdr->head;
 
-		/* sleep without racing on reap and cull with the signal
-		 * handlers */
-		if (!scan && !reap && !cull) {
-			if (sigprocmask(SIG_BLOCK, &sigs, &osigs) < 0)
-				oserror("Unable to block signals");
+	rec = &journal_recs[seq % journal_hdr->nrecords];
+	__atomic_store_n(&rec->seq, CFJ_SEQ_BUSY, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
 
-			if (!reap && !cull) {
-				if (ppoll(pollfds, 1, NULL, &osigs) < 0 &&
-				    errno != EINTR)
-					oserror("Unable to suspend process");
-			}
+	memset(&rec->usec, 0, sizeof(*rec) - offsetof(struct cfj_record, usec));
+	rec->usec = now_usec() - start_time * 1000;
+	rec->event = event;
+	return rec;
+}
 
-			if (sigprocmask(SIG_UNBLOCK, &sigs, NULL) < 0)
-				oserror("Unable to unblock signals");
+static inline void journal_commit(struct cfj_record *rec)
+{
+	uint64_t seq = journal_hdr->head;
 
-			read_cache_state();
-		}
+	__atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&journal_hdr->head, seq + 1, __ATOMIC_RELEASE);
+}
 
-		if (nocull) {
-			cull = 0;
-		} else {
-			if (jumpstart_scan) {
-				jumpstart_scan = 0;
-				if (!stop && !scan) {
-					debug(1, "Refilling cull table");
-					root.usage++;
-					scan = &root;
-				}
-			}
+/*****************************************************************************/
+/*
+ * journal something that happened to an object
+ */
+static void journal_event(enum cfj_event event, struct object *object,
+			  unsigned aux)
+{
+	struct cfj_record *rec;
 
-			if (cull) {
-				if (oldest_ready >= 0)
-					cull_objects();
-				else if (oldest_build < 0)
-					jumpstart_scan = 1;
-			}
+	if (!journal_hdr)
+		return;
 
-			if (scan)
-				build_cull_table();
+	rec = journal_slot(event);
+	rec->ino = object->ino;
+	rec->parent = object->parent ? object->parent->ino : 0;
+	rec->atime = cull_key(object).atime;
+	rec->blocks = object->subtree ? object->sub_blocks : object->blocks;
+	rec->type = object->type;
+	rec->aux = aux;
+	strncpy(rec->name, object->name, sizeof(rec->name) - 1);
+	journal_commit(rec);
+}
 
-			if (!scan && oldest_ready < 0 && oldest_build >= 0)
-				decant_cull_table();
-		}
+/*****************************************************************************/
+/*
+ * close all fds from the given one upwards
+ * - close_range() does it in one go if the kernel has it; otherwise we have to
+ *   try each possible fd
+ */
+static void close_fds_from(int from, int open_max)
+{
+	int loop;
 
-		if (reap)
-			reap_graveyard();
-	}
+#ifdef __NR_close_range
+	if (syscall(__NR_close_range, from, ~0U, 0) == 0)
+		return;
+#endif
 
-	notice("Daemon Terminated");
-	exit(0);
+	for (loop = from; loop < open_max; loop++)
+		close(loop);
 }
 
 /*****************************************************************************/
 /*
- * check the graveyard directory for graves to delete
+ * count the caches described by the config file
  */
-static void reap_graveyard(void)
+static int count_caches(void)
 {
-	/* set a one-shot notification to catch more graves appearing */
-	reap = 0;
-	signal(SIGIO, sigio);
-	if (fcntl(graveyardfd, F_NOTIFY, DN_CREATE) < 0)
-		oserror("unable to set notification on graveyard");
+	FILE *config;
+	size_t m = 0;
+	char *line = NULL, *cp;
+	int n = 0;
+
+	config = fopen(configfile, "r");
+	if (!config)
+		oserror("Unable to open %s", configfile);
+
+	while (getline(&line, &m, config) != EOF) {
+		for (cp = line; isspace(*cp); cp++) {;}
+		if (memcmp(cp, "dir", 3) == 0 && isspace(cp[3]))
+			n++;
+	}
 
-	reap_graveyard_aux(graveyardpath);
+	free(line);
+	fclose(config);
+	return n;
 }
 
 /*****************************************************************************/
 /*
- * recursively remove dead stuff from the graveyard
+ * fork a daemon for each cache and supervise them
+ * - this only returns in the daemons, each of which has cache_index set to
+ *   the cache it should handle and ready_fd set to the fd on which to report
+ *   that its cache is bound
+ * - the foreground process waits to see if all the caches bind
  */
-static void reap_graveyard_aux(const char *dirname)
+static void manage_caches(int ncaches, int nodaemon)
 {
-	struct dirent dirent, *de;
-	DIR *dir;
-	int deleted, ret;
+	int status_pipe[2], ready[2], readyfds[CACHES_MAX];
+	int loop, nready = 0, nlive, status, nullfd;
+	sigset_t sigs, osigs;
+	pid_t pid;
+	char c = 0;
 
-	if (chdir(dirname) < 0)
-		oserror("chdir failed");
+	if (ncaches > CACHES_MAX)
+		opterror("Too many caches (max %d)", CACHES_MAX);
 
-	dir = opendir(".");
-	if (!dir)
-		oserror("Unable to open grave dir %s", dirname);
+	if (!nodaemon) {
+		if (pipe(status_pipe) < 0)
+			oserror("Unable to create pipe");
 
-	do {
-		/* removing directory entries may cause us to skip when reading
-		 * them */
-		rewinddir(dir);
-		deleted = 0;
+		switch (fork()) {
+		case -1:
+			oserror("fork");
 
-		while (ret = readdir_r(dir, &dirent, &de),
-		       ret == 0 && de != NULL
-		       ) {
-			/* ignore "." and ".." */
-			if (dirent.d_name[0] == '.') {
-				if (dirent.d_name[1] == '\0')
-					continue;
-				if (dirent.d_name[1] == '.' ||
-				    dirent.d_name[1] == '\0')
-					continue;
-			}
+		case 0:
+			close(status_pipe[0]);
+			setsid();
+			break;
 
-			deleted = 1;
+		default:
+			close(status_pipe[1]);
+			exit(read(status_pipe[0], &c, 1) == 1 ? 0 : 1);
+		}
+	}
 
-			/* attempt to unlink non-directory files */
-			if (dirent.d_type != DT_DIR) {
-				debug(1, "unlink %s", dirent.d_name);
-				if (unlink(dirent.d_name) == 0)
-					continue;
-				if (errno != EISDIR)
-					oserror("Unable to unlink file %s",
-						dirent.d_name);
-			}
+	/* pass signals on from before the first fork so that none is lost
+	 * whilst the caches are binding; they're held off over each fork so
+	 * that the new daemon's PID is recorded before one can be relayed */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGUSR1);
+
+	signal(SIGTERM, sigrelay);
+	signal(SIGINT, sigrelay);
+	signal(SIGHUP, sigrelay);
+	signal(SIGUSR1, sigrelay);
 
-			/* recurse into directories */
-			memcpy(&dirent, de, sizeof(dirent));
+	for (loop = 0; loop < ncaches; loop++) {
+		if (pipe(ready) < 0)
+			oserror("Unable to create pipe");
 
-			reap_graveyard_aux(dirent.d_name);
+		if (sigprocmask(SIG_BLOCK, &sigs, &osigs) < 0)
+			oserror("Unable to block signals");
 
-			/* which we then attempt to remove */
-			debug(1, "rmdir %s", dirent.d_name);
-			if (rmdir(dirent.d_name) < 0)
-				oserror("Unable to remove dir %s", dirent.d_name);
+		pid = fork();
+		if (pid < 0)
+			oserror("fork");
+
+		if (pid == 0) {
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGINT, SIG_DFL);
+			signal(SIGHUP, SIG_DFL);
+			signal(SIGUSR1, SIG_DFL);
+			if (sigprocmask(SIG_SETMASK, &osigs, NULL) < 0)
+				oserror("Unable to unblock signals");
+			if (dup2(ready[1], 4) < 0)
+				oserror("Unable to transfer ready fd to 4");
+			cache_index = loop;
+			ready_fd = 4;
+			memset(cache_pids, 0, sizeof(cache_pids));
+			ncache_pids = 0;
+			return;
 		}
 
-		if (ret < 0)
-			oserror("Unable to read dir %s", dirname);
-	} while (deleted);
+		close(ready[1]);
+		cache_pids[ncache_pids++] = pid;
+		readyfds[loop] = ready[0];
 
-	closedir(dir);
+		if (sigprocmask(SIG_SETMASK, &osigs, NULL) < 0)
+			oserror("Unable to unblock signals");
+	}
 
-	if (chdir("..") < 0)
-		oserror("Unable to chdir to ..");
-}
+	/* wait for all the caches to be bound */
+	for (loop = 0; loop < ncaches; loop++) {
+		if (read(readyfds[loop], &c, 1) == 1)
+			nready++;
+		close(readyfds[loop]);
+	}
 
-/*****************************************************************************/
-/*
- * read the cache state
- */
-static void read_cache_state(void)
-{
-	char buffer[4096 + 1], *tok, *next, *arg;
-	int n;
+	if (nready < ncaches) {
+		sigrelay(SIGTERM);
+		exit(1);
+	}
 
-	n = read(cachefd, buffer, sizeof(buffer) - 1);
-	if (n < 0)
-		oserror("Unable to read cache state");
-	buffer[n] = '\0';
+	if (!nodaemon) {
+		signal(SIGTTIN, SIG_IGN);
+		signal(SIGTTOU, SIG_IGN);
+		signal(SIGTSTP, SIG_IGN);
+		write_pidfile();
+
+		nullfd = open("/dev/null", O_RDWR);
+		if (nullfd < 0)
+			oserror("Unable to open /dev/null");
+		dup2(nullfd, 0);
+		dup2(nullfd, 1);
+		if (!xdebug)
+			dup2(nullfd, 2);
+		close(nullfd);
 
-	tok = buffer;
-	do {
-		next = strpbrk(tok, " \t");
-		if (next)
-			*next++ = '\0';
+		if (write(status_pipe[1], &c, 1) < 0)
+			oserror("Unable to report caches bound");
+		close(status_pipe[1]);
+	}
 
-		arg = strchr(tok, '=');
-		if (arg)
-			*arg++ = '\0';
+	openlog("cachefilesd", LOG_PID, LOG_DAEMON);
+	xopenedlog = 1;
+	notice("Supervising %d caches", ncaches);
+
+	nlive = ncache_pids;
+	while (nlive > 0) {
+		pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			oserror("Unable to wait for cache daemons");
+		}
 
-		if (strcmp(tok, "cull") == 0)
-			cull = strtoul(arg, NULL, 0);
-		else if (strcmp(tok, "brun") == 0)
-			brun = strtoull(arg, NULL, 16);
-		else if (strcmp(tok, "bcull") == 0)
-			bcull = strtoull(arg, NULL, 16);
-		else if (strcmp(tok, "bstop") == 0)
-			bstop = strtoull(arg, NULL, 16);
-		else if (strcmp(tok, "frun") == 0)
-			frun = strtoull(arg, NULL, 16);
-		else if (strcmp(tok, "fcull") == 0)
-			fcull = strtoull(arg, NULL, 16);
-		else if (strcmp(tok, "fstop") == 0)
-			fstop = strtoull(arg, NULL, 16);
+		for (loop = 0; loop < ncache_pids; loop++) {
+			if (cache_pids[loop] != pid)
+				continue;
 
-	} while ((tok = next));
+			cache_pids[loop] = 0;
+			nlive--;
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				notice("Daemon for cache %d died (status %x)",
+				       loop, status);
+		}
+	}
+
+	notice("Supervisor Terminated");
+	exit(0);
 }
 
 /*****************************************************************************/
 /*
- * find out if an object in the current working directory is in use
+ * open the cache directories
  */
-static int is_object_in_use(const char *filename)
+static void open_cache(void)
 {
-	char buffer[NAME_MAX + 30];
-	int ret, n;
-
-	n = sprintf(buffer, "inuse %s", filename);
+	struct statfs sfs;
+	char buffer[PATH_MAX + 1];
+	long page_size;
 
-	/* command the module */
-	ret = write(cachefd, buffer, n);
-	if (ret < 0 && errno != ESTALE && errno != ENOENT && errno != EBUSY)
-		oserror("Failed to check object's in-use state");
+	/* open the cache directory so we can scan it */
+	snprintf(buffer, PATH_MAX, "%s/cache", cacheroot);
 
-	return ret < 0 && errno == EBUSY ? 1 : 0;
-}
+	tree.root.dir = opendir(buffer);
+	if (!tree.root.dir)
+		oserror("Unable to open cache directory");
+	tree.nopendir++;
 
-/*****************************************************************************/
+	/* open the graveyard so we can set a notification on it */
+	if (asprintf(&graveyardpath, "%s/graveyard", cacheroot) < 0)
+		oserror("Unable to copy graveyard name");
+
+	graveyardfd = open(graveyardpath, O_DIRECTORY);
+	if (graveyardfd < 0)
+		oserror("Unable to open graveyard directory");
+	reaper.graveyardfd = graveyardfd;
+
+	if (fstatfs(graveyardfd, &sfs) < 0)
+		oserror("Unable to stat cache filesystem");
+
+	if (sfs.f_bsize == -1 ||
+	    sfs.f_blocks == -1 ||
+	    sfs.f_bfree == -1 ||
+	    sfs.f_bavail == -1)
+		error("Backing filesystem returns unusable statistics through fstatfs()");
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size < 0)
+		oserror("Unable to get page size");
+
+	cache_bsize = sfs.f_bsize;
+	if (cache_bsize < page_size)
+		cache_bsize = page_size;
+
+	/* on XFS we can harvest inode attributes in bulk rather than statting
+	 * every object */
+	if (!nobulkstat && sfs.f_type == XFS_SUPER_MAGIC) {
+		debug(1, "Cache is on XFS, using bulkstat");
+		use_bulkstat = 1;
+	}
+
+	if (fanotify_wanted && !nocull)
+		open_access_tracking();
+}
+
+/*****************************************************************************/
 /*
- * cull a file representing an object in the current working directory
- * - requests CacheFiles rename the object "<cwd>/filename" to the graveyard
+ * let go of an object that's been dropped from a cull table
+ * - a directory that was there to be culled whole no longer is
  */
-static void cull_file(const char *filename)
+static void drop_cull_entry(struct cull_table *t, struct object *object)
 {
-	char buffer[NAME_MAX + 30];
-	int ret, n;
+	journal_event(CFJ_REMOVE, object, t == &cullready);
+	object->subtree = 0;
+	put_object(object);
+}
 
-	n = sprintf(buffer, "cull %s", filename);
+/*****************************************************************************/
+/*
+ * change the size of the cull tables, keeping what's in them
+ * - when shrinking, the newest objects in each table are let go
+ */
+static void resize_cull_tables(unsigned old_size, const char *why)
+{
+	if (cull_table_resize(&cullbuild, culltable_size, drop_cull_entry) < 0 ||
+	    cull_table_resize(&cullready, culltable_size, drop_cull_entry) < 0)
+		oserror("Unable to resize cull table");
 
-	/* command the module */
-	ret = write(cachefd, buffer, n);
-	if (ret < 0 && errno != ESTALE && errno != ENOENT && errno != EBUSY)
-		oserror("Failed to cull object");
+	snprintf(culltable_reason, sizeof(culltable_reason), "%s", why);
+	notice("Cull tables resized from %u to %u (%s)",
+	       old_size, culltable_size, why);
 }
 
 /*****************************************************************************/
 /*
- * create an object from a name and stat details and attach to the parent, if
- * it doesn't already exist
+ * grow or shrink the cull tables within their bounds according to the demand
+ * for culling since we last looked
  */
-static struct object *create_object(struct object *parent,
-				    const char *name,
-				    struct stat64 *st)
+static void adapt_cull_tables(void)
 {
-	struct object *object, *p, *pr;
-	int len;
+	unsigned long long now = now_msec(), nscanned_window;
+	unsigned old_size = culltable_size;
+	char why[80];
 
-	/* see if the parent object already holds a representation of this
-	 * one */
-	pr = NULL;
-	for (p = parent->children; p; pr = p, p = p->next) {
-		if (p->ino <= st->st_ino) {
-			if (p->ino == st->st_ino) {
-				/* it does */
-				p->usage++;
-				return p;
-			}
-
-			break;
+	if (now < next_adapt)
+		return;
+	next_adapt = now + ADAPT_INTERVAL;
+
+	nscanned_window = nscanned - nscanned_mark;
+	nscanned_mark = nscanned;
+
+	if (nstarved_window > 0 ||
+	    nculled_window >= culltable_size / 2 ||
+	    (nculled_window >= culltable_size / 16 &&
+	     nscanned_window > nculled_window * ADAPT_SCAN_PER_CULL)) {
+		last_demand = now;
+		if (culltable_size < culltable_max) {
+			snprintf(why, sizeof(why),
+				 "%u culled, ran dry %u times, %llu scanned",
+				 nculled_window, nstarved_window,
+				 nscanned_window);
+			culltable_size *= 2;
+			resize_cull_tables(old_size, why);
 		}
 	}
+	else if (nculled_window >= culltable_size / 16) {
+		last_demand = now;
+	}
+	else if (now - last_demand >= ADAPT_SHRINK_AFTER &&
+		 culltable_size > culltable_min) {
+		snprintf(why, sizeof(why), "little culling for %llu mins",
+			 (now - last_demand) / 60000);
+		culltable_size /= 2;
+		resize_cull_tables(old_size, why);
+		last_demand = now;
+	}
 
-	/* allocate the object
-	 * - note that struct object reserves space for NUL directly
-	 */
-	len = strlen(name);
-
-	object = calloc(1, sizeof(struct object) + len);
-	if (!object)
-		oserror("Unable to alloc object");
-
-	object->usage = 1;
-	object->new = 1;
-
-	object->ino = st->st_ino;
-	object->atime = st->st_atime;
-	memcpy(object->name, name, len + 1);
+	nculled_window = 0;
+	nstarved_window = 0;
+}
 
-	switch (object->name[0]) {
-	case 'I':
-	case 'J':
-		object->type = OBJTYPE_INDEX;
-		break;
-	case 'D':
-	case 'E':
-		object->type = OBJTYPE_DATA;
-		break;
-	case 'S':
-	case 'T':
-		object->type = OBJTYPE_SPECIAL;
-		break;
-	case '+':
-	case '@':
-		object->type = OBJTYPE_INTERMEDIATE;
-		break;
-	default:
-		error("Unexpected file type '%c'", object->name[0]);
+/*****************************************************************************/
+/*
+ * see if a config line sets one of the culling limits
+ * - returns the limit's index or -1
+ */
+static int limit_index(const char *cp)
+{
+	size_t len;
+	int loop;
+
+	for (loop = 0; loop < NR_LIMITS; loop++) {
+		len = strlen(limit_names[loop]);
+		if (memcmp(cp, limit_names[loop], len) == 0 &&
+		    (!cp[len] || isspace(cp[len])))
+			return loop;
 	}
 
-	/* link into the parent's list */
-	parent->usage++;
-	object->parent = parent;
-	object->prev = pr;
-	object->next = p;
-	if (pr)
-		pr->next = object;
-	else
-		parent->children = object;
-	if (p)
-		p->prev = object;
-
-	nobjects++;
-	return object;
+	return -1;
 }
 
 /*****************************************************************************/
 /*
- * free up an object, unlinking it from its parent
+ * note a culling limit the kernel has accepted
  */
-static void put_object(struct object *object)
+static void note_limit(int limit, const char *cp)
 {
-	struct object *parent;
-
-	if (--object->usage > 0)
+	if (limit < 0)
 		return;
 
-	nobjects--;
+	cp += strlen(limit_names[limit]);
+	limit_pct[limit] = strtoul(cp, NULL, 10);
+}
 
-	if (object->cullable)
-		ncullable--;
+/*****************************************************************************/
+/*
+ * reread the config file and apply any changes
+ * - the file is checked completely before anything is changed
+ * - the cache can't be moved, retagged or have its security context or
+ *   culling limits changed without rebinding it, so changes to those are only
+ *   noted
+ */
+static void reload_config(void)
+{
+	struct statfs sfs;
+	unsigned lineno, old_size = culltable_size, limits[NR_LIMITS];
+	size_t m = 0;
+	FILE *config;
+	char *line = NULL, *cp;
+	int pass, block, limit, ret = 0, old_cgroup = iothrottle_cgroup;
+
+	notice("Reloading %s", configfile);
+	reloading = 1;
+
+	for (pass = 0; pass < 2; pass++) {
+		config = fopen(configfile, "r");
+		if (!config) {
+			notice("Unable to open %s: %m (not reloaded)",
+			       configfile);
+			goto out;
+		}
 
-	/* destroy the object */
-	if (object == &root)
-		error("Can't destroy root object representation");
+		if (pass == 1) {
+			reset_daemon_options();
+			memcpy(limits, limit_default, sizeof(limits));
+		}
 
-	if (object->children)
-		error("Destroying object with children: '%s'", object->name);
+		lineno = 0;
+		block = 0;
+		while (ret = read_config_line(config, &line, &m, &lineno,
+					      &block, &cp),
+		       ret > 0
+		       ) {
+			ret = parse_daemon_option(cp, lineno, pass);
+			if (ret < 0)
+				break;
+			if (ret > 0 || pass == 0)
+				continue;
+
+			/* the kernel only works out the culling thresholds
+			 * when the cache is bound, so only the debug mask can
+			 * be changed now */
+			limit = limit_index(cp);
+			if (limit >= 0) {
+				cp += strlen(limit_names[limit]);
+				limits[limit] = strtoul(cp, NULL, 10);
+				continue;
+			}
+
+			if (memcmp(cp, "debug", 5) != 0)
+				continue;
+
+			if (write(cachefd, cp, strlen(cp)) < 0)
+				notice("%s:%d: CacheFiles rejected '%s': %m",
+				       configfile, lineno, cp);
+		}
 
-	if (object->dir) {
-		closedir(object->dir);
-		nopendir--;
+		fclose(config);
+		if (ret < 0)
+			goto out;
 	}
 
-	if (object->prev)
-		object->prev->next = object->next;
-	else
-		object->parent->children = object->next;
+	for (limit = 0; limit < NR_LIMITS; limit++)
+		if (limits[limit] != limit_pct[limit])
+			notice("%s %u%% takes effect on restart, %u%% until then",
+			       limit_names[limit], limits[limit],
+			       limit_pct[limit]);
+
+	/* apply the changes, leaving an adaptive table alone if it's still
+	 * within bounds */
+	if (old_size >= culltable_min && old_size <= culltable_max)
+		culltable_size = old_size;
+	if (culltable_size != old_size || (!nocull && !cullbuild.entries))
+		resize_cull_tables(old_size, "config reloaded");
 
-	if (object->next)
-		object->next->prev = object->prev;
+	if (fanotify_wanted && !nocull && fanfd < 0)
+		reopen_access_tracking();
+	if ((!fanotify_wanted || nocull) && fanfd >= 0)
+		close_access_tracking();
 
-	parent = object->parent;
+	/* the stall may now have to be taken from elsewhere */
+	if (iothrottle_cgroup != old_cgroup || (iothrottle && psifd < 0))
+		reopen_io_pressure();
 
-	memset(object, 0x6d, sizeof(struct object));
-	free(object);
+	if (fstatfs(graveyardfd, &sfs) < 0)
+		oserror("Unable to stat cache filesystem");
+	use_bulkstat = !nobulkstat && sfs.f_type == XFS_SUPER_MAGIC;
 
-	if (parent)
-		put_object(parent);
+	state_stale = 1;
+	notice("Reloaded %s", configfile);
+
+out:
+	free(line);
+	reloading = 0;
 }
 
 /*****************************************************************************/
 /*
- * destroy an unexpected object
+ * manage the cache
  */
-static void destroy_unexpected_object(struct object *parent, struct dirent *de)
+static void cachefilesd(void)
 {
-	static unsigned uniquifier;
-	struct timeval tv;
-	char namebuf[40];
-	int fd;
+	sigset_t sigs, osigs;
+	struct timespec timeout, *ptimeout;
+	unsigned long long now, wake;
+	int held;
+
+	struct pollfd pollfds[2] = {
+		[0] = {
+			.fd	= cachefd,
+			.events	= POLLIN,
+		},
+		[1] = {
+			.fd	= -1,
+			.events	= POLLIN,
+		},
+	};
 
-	fd = dirfd(parent->dir);
+	notice("Daemon Started");
 
-	if (de->d_type != DT_DIR) {
-		if (unlinkat(fd, de->d_name, 0) < 0 &&
-		    errno != ENOENT)
-			oserror("Unable to unlink unexpectedly named file: %s",
-				de->d_name);
-	}
-	else {
-		gettimeofday(&tv, NULL);
-		sprintf(namebuf, "x%lxx%xx", tv.tv_sec, uniquifier++);
+	/* open the cache directories */
+	open_cache();
+	pollfds[1].fd = fanfd;
 
-		if (renameat(fd, de->d_name, graveyardfd, namebuf) < 0 &&
-		    errno != ENOENT)
-			oserror("Unable to rename unexpectedly named file: %s",
-				de->d_name);
+	/* without culling there's no cull table to fill before we're ready */
+	if (nocull) {
+		time_to_ready = now_msec() - start_time;
+		notice("Cache ready (%llums after start)", time_to_ready);
 	}
-}
 
-/*****************************************************************************/
-/*
- * insert an object into the cull table if its old enough
- */
-static void insert_into_cull_table(struct object *object)
-{
-	int y, o, m;
+	/* we need to disable I/O and termination signals so they're only
+	 * caught at appropriate times
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGIO);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGHUP);
 
-	if (!object)
-		error("NULL object pointer");
+	signal(SIGTERM, sigterm);
+	signal(SIGINT, sigterm);
+	signal(SIGUSR1, sigusr1);
+	signal(SIGHUP, sighup);
 
-	/* just insert if table is empty */
-	if (oldest_build == -1) {
-		object->usage++;
-		oldest_build = 0;
-		cullbuild[0] = object;
-		return;
-	}
+	/* the cache may be swept in parallel first, which stands in for the
+	 * initial scan */
+	if (sweep_jobs)
+		sweep_cache(sweep_jobs);
 
-	/* insert somewhere if table is not full */
-	if (oldest_build < culltable_size - 1) {
-		object->usage++;
-		oldest_build++;
+	/* check the graveyard for graves */
+	start_slice();
+	reap_graveyard();
 
-		/* just insert at end if new oldest object */
-		if (object->atime <= cullbuild[oldest_build - 1]->atime) {
-			cullbuild[oldest_build] = object;
-			return;
-		}
+	/* the initial scan is a cold one */
+	last_cold_scan = now_msec();
+	last_demand = last_cold_scan;
+	next_adapt = last_cold_scan + ADAPT_INTERVAL;
+	nscanned_mark = nscanned;
+	if (scan)
+		start_bulkstat();
 
-		/* insert at front if new newest object */
-		if (object->atime > cullbuild[0]->atime) {
-			memmove(&cullbuild[1],
-				&cullbuild[0],
-				oldest_build * sizeof(cullbuild[0]));
+	while (!stop) {
+		/* whilst busy, only go to the kernel for the state when it may
+		 * have changed or when we've not looked for half the permitted
+		 * cull latency */
+		now = now_msec();
+		if (state_stale || now >= next_state_read) {
+			read_cache_state();
+			state_stale = 0;
+			next_state_read = now + cullwait / 2;
+		}
 
-			cullbuild[0] = object;
-			return;
+		if (dump_stats_requested) {
+			dump_stats_requested = 0;
+			dump_stats();
 		}
 
-		/* if only two objects in list then insert between them */
-		if (oldest_build == 2) {
-			cullbuild[2] = cullbuild[1];
-			cullbuild[1] = object;
-			return;
+		if (reload_requested) {
+			reload_requested = 0;
+			reload_config();
+			pollfds[1].fd = fanfd;
 		}
 
-		/* insert somewhere in between front and back elements
-		 * of a three object list
-		 * - oldest_build == #objects_currently_in_list
+		if (culltable_max > culltable_min && !nocull)
+			adapt_cull_tables();
+
+		/* sleep without racing on reap and cull with the signal
+		 * handlers
+		 * - if we're sampling the fill rate, wake up for the next
+		 *   sample
+		 * - if the scan is being held back, wake up when it may go on
 		 */
-		y = 1;
-		o = oldest_build - 1;
+		held = scan && scan_held();
+		if ((!scan || held) && !reap && !cull) {
+			ptimeout = NULL;
+			wake = ~0ULL;
+			if (precull_horizon && !nocull)
+				wake = next_fill_sample;
+			if (held) {
+				nscan_holds++;
+				if (scan_resume < wake)
+					wake = scan_resume;
+			}
 
-		do {
-			m = (y + o) / 2;
+			if (wake != ~0ULL) {
+				now = now_msec();
+				now = now < wake ? wake - now : 0;
+				timeout.tv_sec = now / 1000;
+				timeout.tv_nsec = now % 1000 * 1000000;
+				ptimeout = &timeout;
+			}
 
-			if (object->atime > cullbuild[m]->atime)
-				o = m;
-			else
-				y = m + 1;
+			if (sigprocmask(SIG_BLOCK, &sigs, &osigs) < 0)
+				oserror("Unable to block signals");
 
-		} while (y < o);
+			pollfds[0].revents = 0;
+			if (!reap && !cull && !dump_stats_requested &&
+			    !reload_requested) {
+				if (ppoll(pollfds, 2, ptimeout, &osigs) < 0 &&
+				    errno != EINTR)
+					oserror("Unable to suspend process");
+			}
 
-		memmove(&cullbuild[y + 1],
-			&cullbuild[y],
-			(oldest_build - y) * sizeof(cullbuild[0]));
+			if (sigprocmask(SIG_UNBLOCK, &sigs, NULL) < 0)
+				oserror("Unable to unblock signals");
 
-		cullbuild[y] = object;
-		return;
-	}
+			if (pollfds[0].revents & POLLIN) {
+				read_cache_state();
+				next_state_read = now_msec() + cullwait / 2;
+			}
+		}
 
-	/* if table is full then insert only if older than newest */
-	if (oldest_build > culltable_size - 1)
-		error("Cull table overfull");
+		if (nocull) {
+			cull = 0;
+		} else {
+			if (fanfd >= 0)
+				read_access_events();
 
-	if (object->atime >= cullbuild[0]->atime)
-		return;
+			if (jumpstart_scan) {
+				jumpstart_scan = 0;
+				if (!stop && !scan) {
+					debug(1, "Refilling cull table");
+					start_scan(0);
+				}
+			}
 
-	/* newest object in table will be displaced by this one */
-	put_object(cullbuild[0]);
-	cullbuild[0] = (void *)(0x6b000000 | __LINE__);
-	object->usage++;
+			if (precull_horizon && now_msec() >= next_fill_sample)
+				sample_fill_rate();
+
+			if (cull || precull) {
+				if (cullready.oldest >= 0) {
+					cull_objects(cull ? CULL_BATCH_MAX :
+						     PRECULL_BATCH);
+					/* see if the kernel is satisfied */
+					state_stale = 1;
+				} else {
+					if (cull)
+						nstarved_window++;
+					if (cullbuild.oldest < 0)
+						jumpstart_scan = 1;
+				}
+				precull = 0;
+			}
 
-	/* place directly in first slot if second is older */
-	if (object->atime >= cullbuild[1]->atime) {
-		cullbuild[0] = object;
-		return;
-	}
+			if (scan && !scan_held()) {
+				start_slice();
+				build_cull_table();
+				if (scan_delay)
+					scan_resume = now_msec() + scan_delay;
+			}
 
-	/* shift everything up one if older than oldest */
-	if (object->atime <= cullbuild[culltable_size - 1]->atime) {
-		memmove(&cullbuild[0],
-			&cullbuild[1],
-			(culltable_size - 1) * sizeof(cullbuild[0]));
+			if (!scan && cullready.oldest < 0 && cullbuild.oldest >= 0)
+				decant_cull_table();
+		}
 
-		cullbuild[culltable_size - 1] = object;
-		return;
+		if (reap) {
+			start_slice();
+			reap_graveyard();
+			if (!reap)
+				state_stale = 1;
+		}
 	}
 
-	/* search the table to find the insertion point
-	 * - it will be between the first and last the slots
-	 * - we know second is younger
-	 */
-	cullbuild[0] = cullbuild[1];
-
-	y = 2;
-	o = culltable_size - 1;
-
-	do {
-		m = (y + o) / 2;
+	notice("Daemon Terminated");
+	exit(0);
+}
 
-		if (object->atime >= cullbuild[m]->atime)
-			o = m;
-		else
-			y = m + 1;
+/*****************************************************************************/
+/*
+ * check the graveyard directory for graves to delete
+ */
+static void reap_graveyard(void)
+{
+	int ret;
 
-	} while (y < o);
+	/* set a one-shot notification to catch more graves appearing */
+	reap = 0;
+	signal(SIGIO, sigio);
+	if (fcntl(graveyardfd, F_NOTIFY, DN_CREATE) < 0)
+		oserror("unable to set notification on graveyard");
 
-	if (y == 2) {
-		cullbuild[1] = object;
+	/* we may have to come back to finish off */
+	ret = reaper_reap(&reaper, cache_pressure());
+	if (ret < 0) {
+		errno = -ret;
+		oserror("Unable to reap the graveyard");
+	}
+	if (ret == 0) {
+		reap = 1;
 		return;
 	}
 
-	memmove(&cullbuild[1],
-		&cullbuild[2],
-		(y - 2) * sizeof(cullbuild[0]));
-
-	cullbuild[y - 1] = object;
+	/* everything culled so far has now been given back */
+	pending_bytes = 0;
+	pending_files = 0;
 }
 
 /*****************************************************************************/
 /*
- * do the next step in building up the cull table
+ * note something the reaper has removed from the graveyard
  */
-static void build_cull_table(void)
+static void note_reaped(struct reaper *r, const char *name,
+			unsigned long long blocks, int isdir)
 {
-	struct dirent dirent, *de;
-	struct object *curr, *child;
-	struct stat64 st;
-	int loop, fd;
-
-	curr = scan;
-
-	if (!curr->dir) {
-		curr->empty = 1;
-
-		fd = openat(dirfd(curr->parent->dir), curr->name, O_DIRECTORY);
-		if (fd < 0) {
-			if (errno != ENOENT)
-				oserror("Failed to open directory");
-			goto dir_read_complete;
-		}
+	struct cfj_record *rec;
 
-		curr->dir = fdopendir(fd);
-		if (!curr->dir)
-			oserror("Failed to open directory");
+	debug(1, "%s %s", isdir ? "rmdir" : "unlink", name);
 
-		nopendir++;
+	if (journal_hdr && !isdir) {
+		rec = journal_slot(CFJ_REAP);
+		rec->blocks = blocks;
+		strncpy(rec->name, name, sizeof(rec->name) - 1);
+		journal_commit(rec);
 	}
+}
 
-	debug(2, "--> build_cull_table({%s})", curr->name);
+/*****************************************************************************/
+/*
+ * see what, if anything, the cache is short of
+ */
+static enum reap_pressure cache_pressure(void)
+{
+	unsigned long long bavail, ffree;
 
-	if (fchdir(dirfd(curr->dir)) < 0)
-		oserror("Failed to change current directory");
+	read_fs_free(&bavail, &ffree);
 
-next:
-	/* read the next directory entry */
-	if (readdir_r(curr->dir, &dirent, &de) < 0) {
-		if (errno == ENOENT)
-			goto dir_read_complete;
-		oserror("Unable to read directory");
-	}
+	if (bavail < bcull)
+		return BLOCK_PRESSURE;
+	if (ffree < fcull)
+		return FILE_PRESSURE;
+	return NO_PRESSURE;
+}
 
-	if (de == NULL)
-		goto dir_read_complete;
+/*****************************************************************************/
+/*
+ * read the cache state
+ * - the state doesn't change much, so don't reparse it if it's the same as
+ *   last time
+ */
+static void read_cache_state(void)
+{
+	char buffer[4096 + 1], *tok, *next, *arg;
+	int n;
 
-	if (dirent.d_name[0] == '.') {
-		if (!dirent.d_name[1] ||
-		    (dirent.d_name[1] == '.' && !dirent.d_name[2]))
-			goto next;
-	}
+	n = read(cachefd, buffer, sizeof(buffer) - 1);
+	if (n < 0)
+		oserror("Unable to read cache state");
+	buffer[n] = '\0';
+	nstate_reads++;
 
-	debug(2, "readdir '%s'", dirent.d_name);
+	if (n == state_len && memcmp(buffer, state_buffer, n) == 0)
+		return;
+	memcpy(state_buffer, buffer, n + 1);
+	state_len = n;
+	nstate_parses++;
+
+	tok = buffer;
+	do {
+		next = strpbrk(tok, " \t");
+		if (next)
+			*next++ = '\0';
+
+		arg = strchr(tok, '=');
+		if (arg)
+			*arg++ = '\0';
+
+		if (strcmp(tok, "cull") == 0) {
+			n = strtoul(arg, NULL, 0);
+			if (n && !cull)
+				cull_raised = now_msec();
+			cull = n;
+		}
+		else if (strcmp(tok, "brun") == 0)
+			brun = strtoull(arg, NULL, 16);
+		else if (strcmp(tok, "bcull") == 0)
+			bcull = strtoull(arg, NULL, 16);
+		else if (strcmp(tok, "bstop") == 0)
+			bstop = strtoull(arg, NULL, 16);
+		else if (strcmp(tok, "frun") == 0)
+			frun = strtoull(arg, NULL, 16);
+		else if (strcmp(tok, "fcull") == 0)
+			fcull = strtoull(arg, NULL, 16);
+		else if (strcmp(tok, "fstop") == 0)
+			fstop = strtoull(arg, NULL, 16);
+
+	} while ((tok = next));
+}
+
+/*****************************************************************************/
+/*
+ * find out if an object in the current working directory is in use
+ */
+static int is_object_in_use(const char *filename)
+{
+	char buffer[NAME_MAX + 30];
+	int ret, n;
+
+	n = sprintf(buffer, "inuse %s", filename);
+	ninuse_checks++;
+
+	/* command the module */
+	ret = write(cachefd, buffer, n);
+	if (ret < 0 && errno != ESTALE && errno != ENOENT && errno != EBUSY)
+		oserror("Failed to check object's in-use state");
+
+	return ret < 0 && errno == EBUSY ? 1 : 0;
+}
+
+/*****************************************************************************/
+/*
+ * find an object's slot in the busy cache
+ */
+static struct busy_object *busy_slot(struct object *object)
+{
+	unsigned long h = object->parent->ino * 31 + object->ino;
+
+	return &busy_objects[h & (BUSY_HASH_SIZE - 1)];
+}
+
+/*****************************************************************************/
+/*
+ * see if an object was found to be in use recently enough that we shouldn't
+ * ask again yet
+ */
+static int recently_busy(struct object *object)
+{
+	struct busy_object *b = busy_slot(object);
+
+	if (b->ino != object->ino ||
+	    b->parent != object->parent->ino ||
+	    now_msec() >= b->until)
+		return 0;
+
+	debug(2, "- recently busy");
+	nbusy_hits++;
+	return 1;
+}
+
+/*****************************************************************************/
+/*
+ * note whether an object was found to be in use
+ * - the backoff doubles each time it's found to still be in use
+ */
+static void note_busy(struct object *object, int busy)
+{
+	struct busy_object *b = busy_slot(object);
+	int match;
+
+	match = b->ino == object->ino && b->parent == object->parent->ino;
+
+	if (!busy) {
+		if (match)
+			b->ino = 0;
+		return;
+	}
+
+	journal_event(CFJ_BUSY, object, 0);
+
+	if (match) {
+		b->backoff *= 2;
+		if (b->backoff > BUSY_BACKOFF_MAX)
+			b->backoff = BUSY_BACKOFF_MAX;
+	}
+	else {
+		b->parent = object->parent->ino;
+		b->ino = object->ino;
+		b->backoff = BUSY_BACKOFF_MIN;
+	}
+
+	b->until = now_msec() + b->backoff;
+}
+
+/*****************************************************************************/
+/*
+ * find an object's slot in the ghost list
+ */
+static struct ghost *ghost_slot(struct object *object, uint32_t *_namehash)
+{
+	const unsigned char *p;
+	uint32_t h = 2166136261U;
+
+	for (p = (const unsigned char *) object->name; *p; p++)
+		h = (h ^ *p) * 16777619U;
+
+	*_namehash = h;
+	h ^= object->parent->ino * 31;
+	return &ghosts[h & (GHOST_HASH_SIZE - 1)];
+}
+
+/*****************************************************************************/
+/*
+ * remember an object we've just culled
+ * - an older ghost in the same slot is displaced
+ */
+static void note_ghost(struct object *object)
+{
+	struct ghost *g;
+	uint32_t namehash;
+
+	g = ghost_slot(object, &namehash);
+	g->parent = object->parent->ino;
+	g->namehash = namehash;
+	g->regrets = object->regrets;
+	g->culled = time(NULL);
+	nghost_culls++;
+}
+
+/*****************************************************************************/
+/*
+ * see if a newly found object is one we culled recently and, if so, count
+ * the cull as a regret
+ */
+static void check_ghost(struct object *object)
+{
+	struct ghost *g;
+	uint32_t namehash;
+
+	g = ghost_slot(object, &namehash);
+	if (!g->culled ||
+	    g->namehash != namehash ||
+	    g->parent != object->parent->ino)
+		return;
+
+	if (time(NULL) - g->culled < GHOST_TTL) {
+		debug(1, "Regret culling %s", object->name);
+		nregrets++;
+		object->regrets = g->regrets;
+		if (object->regrets < GHOST_REGRETS_MAX)
+			object->regrets++;
+	}
+
+	g->culled = 0;
+}
+
+/*****************************************************************************/
+/*
+ * cull a file representing an object in the current working directory
+ * - requests CacheFiles rename the object "<cwd>/filename" to the graveyard
+ * - returns 0 if the object was culled and -1 if it was gone or busy
+ */
+static int cull_file(const char *filename)
+{
+	char buffer[NAME_MAX + 30];
+	int ret, n;
+
+	n = sprintf(buffer, "cull %s", filename);
+	ncull_cmds++;
+
+	/* command the module */
+	ret = write(cachefd, buffer, n);
+	if (ret < 0 && errno != ESTALE && errno != ENOENT && errno != EBUSY)
+		oserror("Failed to cull object");
+
+	if (ret < 0 && errno == EBUSY)
+		nbusy_culls++;
+
+	if (ret < 0)
+		return -1;
+
+	note_cull_latency();
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * note an object that's been added to the tree
+ */
+static void discover_object(struct object_tree *tree, struct object *object)
+{
+	if (object->type == OBJTYPE_DATA || object->type == OBJTYPE_SPECIAL)
+		hash_object(object);
+
+	journal_event(CFJ_DISCOVER, object, 0);
+}
+
+/*****************************************************************************/
+/*
+ * forget an object that's about to be freed
+ */
+static void release_object(struct object_tree *tree, struct object *object)
+{
+	if (object->cullable)
+		ncullable--;
+
+	unhash_object(object);
+}
+
+/*****************************************************************************/
+/*
+ * create an object from a name and stat details and attach to the parent, if
+ * it doesn't already exist
+ */
+static struct object *create_object(struct object *parent,
+				    const char *name,
+				    struct stat64 *st)
+{
+	struct object *object;
+
+	object = object_create(&tree, parent, name, st);
+	if (!object) {
+		if (errno == EINVAL)
+			error("Unexpected file type '%c'", name[0]);
+		oserror("Unable to alloc object");
+	}
+	return object;
+}
+
+/*****************************************************************************/
+/*
+ * see if the object tree has outgrown its memory budget
+ */
+static int over_objmem(void)
+{
+	return objmem_limit &&
+		tree.objmem + tree.nopendir * DIR_MEM_ESTIMATE > objmem_limit;
+}
+
+/*****************************************************************************/
+/*
+ * see if the cull table being built is full
+ * - the table is considered full if the object tree is over budget
+ */
+static int build_table_full(void)
+{
+	return cullbuild.oldest >= (int)culltable_size - 1 ||
+		(cullbuild.oldest >= 2 && over_objmem());
+}
+
+/*****************************************************************************/
+/*
+ * free up an object, unlinking it from its parent
+ */
+static void put_object(struct object *object)
+{
+	if (object_put(&tree, object) == 0)
+		return;
+
+	if (object == &tree.root)
+		error("Can't destroy root object representation");
+	error("Destroying object with children: '%s'", object->name);
+}
+
+/*****************************************************************************/
+/*
+ * destroy an unexpected object
+ * - files are unlinked and directories moved to the graveyard to be reaped
+ * - the graves are named by process as well as time as the startup sweep may
+ *   be burying things in several processes at once
+ */
+static void destroy_unexpected_object(int fd, const char *name,
+				      unsigned char type)
+{
+	static unsigned uniquifier;
+	struct timeval tv;
+	char namebuf[40];
+
+	if (type != DT_DIR) {
+		if (unlinkat(fd, name, 0) == 0 || errno == ENOENT)
+			return;
+		if (errno != EISDIR)
+			oserror("Unable to unlink unexpectedly named file: %s",
+				name);
+	}
+
+	gettimeofday(&tv, NULL);
+	sprintf(namebuf, "x%lxx%xx%xx", tv.tv_sec, getpid(), uniquifier++);
+
+	if (renameat(fd, name, graveyardfd, namebuf) < 0 &&
+	    errno != ENOENT)
+		oserror("Unable to rename unexpectedly named file: %s", name);
+}
+
+/*****************************************************************************/
+/*
+ * get the key by which an object is ranked for culling
+ * - objects that have been recreated after being culled are protected by
+ *   making them look younger than they are
+ * - objects accessed at the same time are ranked by inode number
+ * - a directory to be culled whole is ranked by the newest atime within it
+ */
+static inline struct cull_key cull_key(struct object *object)
+{
+	struct cull_key key = {
+		.atime	= (object->subtree ? object->subtree_atime :
+			   object->atime) +
+			  (long long) object->regrets *
+			  ghostprotect * NSEC_PER_SEC,
+		.ino	= object->ino,
+	};
+
+	return key;
+}
+
+/*****************************************************************************/
+/*
+ * insert an object into the cull table if its old enough
+ * - returns 1 if the object was inserted, 0 if it was too young
+ */
+static int insert_into_cull_table(struct object *object)
+{
+	struct object *displaced;
+	int ret;
+
+	if (!object)
+		error("NULL object pointer");
+
+	ret = cull_table_insert(&cullbuild, cull_key(object), object,
+				build_table_full(), &displaced);
+	if (ret < 0)
+		error("Cull table overfull");
+
+	/* the newest object in the table may have been displaced */
+	if (displaced) {
+		journal_event(CFJ_DISPLACE, displaced, 0);
+		displaced->subtree = 0;
+		put_object(displaced);
+	}
+
+	if (ret > 0) {
+		object->usage++;
+		journal_event(CFJ_INSERT, object, 0);
+	}
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * start harvesting the attributes of the inodes on an XFS cache filesystem in
+ * inode order so that the scanner need not stat each object it finds
+ */
+static void start_bulkstat(void)
+{
+	struct statfs sfs;
+	unsigned long long want, budget;
+	unsigned long size;
+
+	if (!use_bulkstat)
+		return;
+
+	discard_bulkstat();
+
+	/* size the hash table from the number of inodes in use, though if
+	 * we've already seen the whole cache, its own object count (plus some
+	 * room for growth) is a better guide on a shared filesystem */
+	if (fstatfs(graveyardfd, &sfs) < 0)
+		oserror("Unable to stat cache filesystem");
+	bulkstat_bsize = sfs.f_bsize;
+
+	want = sfs.f_files - sfs.f_ffree;
+	if (tree.nobjects > 1 && want > tree.nobjects + tree.nobjects / 4)
+		want = tree.nobjects + tree.nobjects / 4;
+
+	for (size = 1024;
+	     size < want * 2 && size < BULKSTAT_MAX * 2;
+	     size <<= 1) {;}
+
+	/* the table is charged to the object memory budget whilst it exists
+	 * and may take no more than half of what the tree isn't using */
+	if (objmem_limit) {
+		budget = objmem_limit > tree.objmem ?
+			(objmem_limit - tree.objmem) / 2 : 0;
+		while (size > 1024 && size * sizeof(bulkstat_tab[0]) > budget)
+			size >>= 1;
+		if (size * sizeof(bulkstat_tab[0]) > budget) {
+			debug(1, "No room in objmem for bulkstat, statting");
+			return;
+		}
+	}
+
+	bulkstat_tab = calloc(size, sizeof(bulkstat_tab[0]));
+	bulkstat_req = calloc(1, sizeof(*bulkstat_req) +
+			      BULKSTAT_BATCH * sizeof(bulkstat_req->bulkstat[0]));
+	if (!bulkstat_tab || !bulkstat_req)
+		oserror("Unable to allocate bulkstat buffers");
+	bulkstat_mask = size - 1;
+	tree.objmem += size * sizeof(bulkstat_tab[0]);
+
+	bulkstat_req->hdr.ino = 0;
+	bulkstat_req->hdr.icount = BULKSTAT_BATCH;
+}
+
+/*****************************************************************************/
+/*
+ * do the next part of the bulkstat harvest
+ * - returns 1 when the harvest is complete, 0 if we ran out of time
+ * - if bulkstat turns out not to be available, fall back to statting
+ */
+static int harvest_bulkstat(void)
+{
+	struct xfs_bulkstat_req *req = bulkstat_req;
+	struct xfs_bulkstat *bs;
+	struct bulkstat_rec *rec;
+	unsigned long max = (bulkstat_mask + 1) / 2, h;
+	unsigned loop;
+
+	if (!req)
+		return 1;
+
+	while (bulkstat_count < max) {
+		if (slice_expired())
+			return 0;
+
+		if (ioctl(dirfd(tree.root.dir), XFS_IOC_BULKSTAT, req) < 0) {
+			if (errno != ENOTTY && errno != EINVAL &&
+			    errno != EPERM && errno != EOPNOTSUPP)
+				oserror("XFS bulkstat failed");
+			notice("XFS bulkstat unavailable (%m), statting instead");
+			use_bulkstat = 0;
+			discard_bulkstat();
+			return 1;
+		}
+
+		if (req->hdr.ocount == 0)
+			break;
+
+		for (loop = 0; loop < req->hdr.ocount; loop++) {
+			bs = &req->bulkstat[loop];
+			if (!S_ISREG(bs->bs_mode) && !S_ISDIR(bs->bs_mode))
+				continue;
+
+			for (h = bs->bs_ino & bulkstat_mask;
+			     bulkstat_tab[h].ino;
+			     h = (h + 1) & bulkstat_mask) {;}
+
+			rec = &bulkstat_tab[h];
+			rec->ino	= bs->bs_ino;
+			rec->atime	= bs->bs_atime;
+			rec->atime_nsec	= bs->bs_atime_nsec;
+			rec->mtime	= bs->bs_mtime;
+			rec->blocks	= bs->bs_blocks * (bulkstat_bsize / 512);
+			rec->mode	= bs->bs_mode;
+			if (++bulkstat_count >= max)
+				break;
+		}
+	}
+
+	free(bulkstat_req);
+	bulkstat_req = NULL;
+	debug(1, "Harvested %lu inodes by bulkstat", bulkstat_count);
+	return 1;
+}
+
+/*****************************************************************************/
+/*
+ * look up the harvested attributes of an inode
+ * - returns 1 and fills in the important bits of *st if found
+ */
+static int lookup_bulkstat(ino_t ino, struct stat64 *st)
+{
+	struct bulkstat_rec *rec;
+	unsigned long h;
+
+	if (!bulkstat_tab || bulkstat_req)
+		return 0;
+
+	for (h = ino & bulkstat_mask;
+	     bulkstat_tab[h].ino;
+	     h = (h + 1) & bulkstat_mask) {
+		rec = &bulkstat_tab[h];
+		if (rec->ino != ino)
+			continue;
+
+		memset(st, 0, sizeof(*st));
+		st->st_ino		= rec->ino;
+		st->st_mode		= rec->mode;
+		st->st_atim.tv_sec	= rec->atime;
+		st->st_atim.tv_nsec	= rec->atime_nsec;
+		st->st_mtim.tv_sec	= rec->mtime;
+		st->st_blocks		= rec->blocks;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * discard the harvested inode attributes
+ */
+static void discard_bulkstat(void)
+{
+	free(bulkstat_req);
+	bulkstat_req = NULL;
+	if (bulkstat_tab)
+		tree.objmem -= (bulkstat_mask + 1) * sizeof(bulkstat_tab[0]);
+	free(bulkstat_tab);
+	bulkstat_tab = NULL;
+	bulkstat_count = 0;
+}
+
+/*****************************************************************************/
+/*
+ * remove an object from whichever cull table it's in, dropping the table's ref
+ * - returns 1 if the object was found, 0 otherwise
+ */
+static int remove_from_cull_table(struct object *object)
+{
+	if (cull_table_remove(&cullready, object)) {
+		journal_event(CFJ_REMOVE, object, 1);
+		object->subtree = 0;
+		put_object(object);
+		return 1;
+	}
+
+	if (cull_table_remove(&cullbuild, object)) {
+		journal_event(CFJ_REMOVE, object, 0);
+		object->subtree = 0;
+		put_object(object);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*****************************************************************************/
+/*
+ * start a fresh summary of a directory's subtree
+ */
+static void reset_subtree(struct object *dir)
+{
+	dir->sub_atime = 0;
+	dir->sub_blocks = 0;
+	dir->sub_files = 0;
+	dir->sub_busy = 0;
+}
+
+/*****************************************************************************/
+/*
+ * fold an object or the summary of a subdirectory into a directory's summary
+ */
+static void add_to_subtree(struct object *dir, long long atime, blkcnt64_t blocks,
+			   unsigned files, int busy)
+{
+	if (atime > dir->sub_atime)
+		dir->sub_atime = atime;
+	dir->sub_blocks += blocks;
+	dir->sub_files += files;
+	dir->sub_busy |= busy;
+}
+
+/*****************************************************************************/
+/*
+ * find the directory, if any, that's in a cull table to be culled whole with
+ * the given object inside it
+ */
+static struct object *covering_subtree(struct object *object)
+{
+	struct object *p;
+
+	for (p = object->parent; p; p = p->parent)
+		if (p->subtree)
+			return p;
+	return NULL;
+}
+
+/*****************************************************************************/
+/*
+ * drop the entries for objects that will be culled along with a directory
+ * from a cull table
+ * - this is done once per decant rather than whenever a directory goes in so
+ *   that the table is only gone through once a scan
+ */
+static void drop_covered_entries(struct cull_table *t)
+{
+	struct cull_entry *table = t->entries;
+	int loop, keep = 0;
+
+	for (loop = 0; loop <= t->oldest; loop++) {
+		if (covering_subtree(table[loop].object))
+			drop_cull_entry(t, table[loop].object);
+		else
+			table[keep++] = table[loop];
+	}
+
+	for (loop = keep; loop <= t->oldest; loop++)
+		table[loop].object = (void *)(0x6b000000 | __LINE__);
+	t->oldest = keep - 1;
+}
+
+/*****************************************************************************/
+/*
+ * see if an index directory we've just finished scanning can be culled whole
+ * - it can if nothing in it was in use and everything in it is older than
+ *   the newest object in a full build table, in which case all of it would be
+ *   culled before anything in the build table anyway
+ * - the entries for the objects within it are superseded by one for the
+ *   directory, ranked by the newest atime in the subtree; they're dropped
+ *   when they come to be culled or the build table is next decanted
+ */
+static void consider_subtree_cull(struct object *dir)
+{
+	/* a subtree already in the table will have been taken out again by now
+	 * if the scan found anything in it used since it went in */
+	if (dir->subtree)
+		return;
+
+	if (nocull ||
+	    dir->type != OBJTYPE_INDEX ||
+	    dir->sub_busy ||
+	    dir->sub_files == 0 ||
+	    !build_table_full() ||
+	    dir->sub_atime >= cullbuild.entries[0].key.atime)
+		return;
+
+	debug(1, "Cold subtree %s (%u files, %llu blocks)",
+	      dir->name, dir->sub_files, (unsigned long long)dir->sub_blocks);
+
+	dir->subtree_atime = dir->sub_atime;
+	dir->subtree = 1;
+	dir->subtree = insert_into_cull_table(dir);
+}
+
+/*****************************************************************************/
+/*
+ * read the whole of a directory and sort the entries into inode order so that
+ * statting them walks the inode table in order rather than in directory hash
+ * order
+ * - this may take several goes if the directory is large
+ * - returns 1 when the list is complete, 0 if we ran out of time and -1 if
+ *   the directory has been removed
+ */
+static int fill_dirlist(struct object *dir)
+{
+	int ret;
+
+	ret = dirlist_fill(dir, 1, slice_expired);
+	if (ret == -ENOENT)
+		return -1;
+	if (ret < 0) {
+		errno = -ret;
+		oserror("Unable to read directory");
+	}
+	return ret;
+}
+
+/*****************************************************************************/
+/*
+ * see if the name of a file in the cache isn't one that CacheFiles makes
+ */
+static int unexpected_name(const char *name)
+{
+	return memchr("IDSJET+@", name[0], 8) == NULL;
+}
+
+/*****************************************************************************/
+/*
+ * see if a file in the cache isn't of the type its name says it should be
+ * - index and intermediate objects are directories; data and special objects
+ *   may be files or directories
+ */
+static int unexpected_type(const char *name, mode_t mode)
+{
+	return !S_ISDIR(mode) &&
+		(!S_ISREG(mode) ||
+		 name[0] == 'I' ||
+		 name[0] == 'J' ||
+		 name[0] == '@' ||
+		 name[0] == '+');
+}
+
+/*****************************************************************************/
+/*
+ * do the next step in building up the cull table
+ */
+static void build_cull_table(void)
+{
+	struct dirlist_entry *ent;
+	struct dirent dirent;
+	struct object *curr, *child, *prev, *cover;
+	struct stat64 st;
+	int fd, busy;
+
+	/* wait for the bulkstat harvest to complete before walking */
+	if (!harvest_bulkstat())
+		return;
+
+	curr = scan;
+
+	if (!curr->dir) {
+		curr->empty = 1;
+		curr->ncandidates = 0;
+
+		/* the parent's directory won't be open if this is the top of a
+		 * hot scan */
+		fd = get_dir_fd(curr);
+		if (fd < 0)
+			goto dir_read_complete;
+
+		curr->dir = fdopendir(fd);
+		if (!curr->dir)
+			oserror("Failed to open directory");
+
+		tree.nopendir++;
+	}
+
+	debug(2, "--> build_cull_table({%s})", curr->name);
+
+	if (fchdir(dirfd(curr->dir)) < 0)
+		oserror("Failed to change current directory");
+
+	/* read the entire directory up front so that we can go through it in
+	 * inode order */
+	if (!curr->list)
+		reset_subtree(curr);
+	if (!curr->list || !curr->list->complete) {
+		switch (fill_dirlist(curr)) {
+		case 0:
+			debug(2, "<-- build_cull_table({%s}) [yield]", curr->name);
+			return;
+		case -1:
+			goto dir_read_complete;
+		}
+	}
+
+next:
+	/* get the next directory entry */
+	if (curr->list->pos >= curr->list->nentries)
+		goto dir_read_complete;
+
+	/* give the main loop a chance to service culling */
+	if (slice_expired()) {
+		debug(2, "<-- build_cull_table({%s}) [yield]", curr->name);
+		return;
+	}
+
+	ent = &curr->list->entries[curr->list->pos++];
+	nscanned++;
+	dirent.d_ino = ent->ino;
+	dirent.d_type = ent->type;
+	strcpy(dirent.d_name, curr->list->names + ent->name);
+
+	debug(2, "readdir '%s'", dirent.d_name);
+
+	switch (dirent.d_type) {
+	case DT_UNKNOWN:
+	case DT_DIR:
+	case DT_REG:
+		break;
+	default:
+		oserror("readdir returned unsupported type %d", dirent.d_type);
+	}
+
+	/* delete any funny looking files */
+	if (unexpected_name(dirent.d_name))
+		goto found_unexpected_object;
+
+	/* if accesses are being tracked then objects we already know about
+	 * needn't be restatted to see if they've been used */
+	if (fanfd >= 0 && !access_lost && !access_catchup) {
+		child = object_find(curr, dirent.d_ino, &prev);
+		if (child && child->ino == dirent.d_ino && !child->new &&
+		    (child->type == OBJTYPE_DATA ||
+		     child->type == OBJTYPE_SPECIAL)) {
+			curr->empty = 0;
+			add_to_subtree(curr, child->atime, child->blocks, 1, 0);
+			goto next;
+		}
+	}
+
+	/* see if this object is already known to us */
+	if (!lookup_bulkstat(dirent.d_ino, &st)) {
+		nstats++;
+		if (fstatat64(dirfd(curr->dir), dirent.d_name, &st, 0) < 0) {
+			if (errno == ENOENT)
+				goto next;
+			oserror("Failed to stat directory");
+		}
+	}
+
+	apply_access_time(&st);
+
+	if (unexpected_type(dirent.d_name, st.st_mode))
+		goto found_unexpected_object;
+
+	/* create a representation for this object */
+	child = create_object(curr, dirent.d_name, &st);
+	if (!child && errno == ENOENT)
+		goto next;
+
+	curr->empty = 0;
+
+	if (!child)
+		oserror("Unable to create object");
+
+	child->mtime = st.st_mtime;
+	if (child->new)
+		check_ghost(child);
+
+	/* we consider culling objects at the transition from index object to
+	 * non-index object */
+	switch (child->type) {
+	case OBJTYPE_DATA:
+	case OBJTYPE_SPECIAL:
+		if (!child->new) {
+			/* the child appears to have been retained in the
+			 * culling table already, so we see if it should be
+			 * removed therefrom
+			 */
+			debug(2, "- old child");
+
+			if (stat_atime(&st) <= child->atime) {
+				/* file on disk hasn't been touched */
+				add_to_subtree(curr, child->atime,
+					       child->blocks, 1, 0);
+				put_object(child);
+				goto next;
+			}
+
+			remove_from_cull_table(child);
+			child->atime = stat_atime(&st);
+			child->blocks = st.st_blocks;
+		}
+
+		/* add objects that aren't in use to the cull table */
+		busy = recently_busy(child);
+		if (!busy) {
+			busy = is_object_in_use(dirent.d_name);
+			note_busy(child, busy);
+		}
+
+		/* an object in a directory that's to be culled whole doesn't
+		 * need an entry of its own, unless it's been used since the
+		 * directory went in, in which case the directory mustn't be
+		 * culled whole after all */
+		cover = covering_subtree(child);
+		while (cover &&
+		       (busy || child->atime > cover->subtree_atime)) {
+			debug(1, "Subtree %s used", cover->name);
+			remove_from_cull_table(cover);
+			cover = covering_subtree(child);
+		}
+
+		if (!busy && !cover) {
+			debug(2, "- insert");
+			child->new = 0;
+			if (insert_into_cull_table(child))
+				curr->ncandidates++;
+		}
+		add_to_subtree(curr, child->atime, child->blocks, 1, busy);
+		put_object(child);
+		goto next;
+
+		/* investigate all index and index-intermediate directories */
+	case OBJTYPE_INDEX:
+	case OBJTYPE_INTERMEDIATE:
+		debug(2, "- descend");
+
+		child->new = 0;
+		scan = child;
+
+		debug(2, "<-- build_cull_table({%s})", curr->name);
+		return;
+
+	default:
+		error("Unexpected type");
+	}
+
+	/* we've finished reading a directory - see if we can cull it */
+dir_read_complete:
+	debug(2, "dir_read_complete: u=%d e=%d %s",
+	      curr->usage, curr->empty, curr->name);
+
+	dirlist_free(curr);
+
+	if (curr->dir) {
+		if (curr != &tree.root) {
+			closedir(curr->dir);
+			curr->dir = NULL;
+			tree.nopendir--;
+		}
+		else {
+			rewinddir(curr->dir);
+		}
+	}
+
+	if (curr != &tree.root) {
+		update_hotdirs(curr);
+
+		/* see if the whole subtree can go, then pass the summary up if
+		 * the parent is also being scanned */
+		if (dircull)
+			consider_subtree_cull(curr);
+		if (curr != scan_top)
+			add_to_subtree(curr->parent, curr->sub_atime,
+				       curr->sub_blocks, curr->sub_files,
+				       curr->sub_busy);
+	}
+
+	if (curr->usage == 1 && curr->empty) {
+		/* attempt to cull unpinned empty intermediate and index
+		 * objects */
+		fd = get_dir_fd(curr->parent);
+		if (fd >= 0) {
+			if (fchdir(fd) < 0)
+				oserror("Failed to change current directory");
+
+			switch (curr->type) {
+			case OBJTYPE_INDEX:
+				cull_file(curr->name);
+				break;
+
+			case OBJTYPE_INTERMEDIATE:
+				unlinkat(fd, curr->name, AT_REMOVEDIR);
+				break;
+
+			default:
+				break;
+			}
+
+			close(fd);
+		}
+	}
+
+	/* a hot scan stops at the directory it started from and moves on to
+	 * the next hot directory in the round */
+	if (curr == scan_top) {
+		scan = NULL;
+		if (nhotround > 0) {
+			scan = scan_top = hotround[--nhotround];
+			debug(1, "Hot scan of %s", scan->name);
+		}
+	}
+	else {
+		scan = curr->parent;
+	}
+
+	if (!scan) {
+		debug(1, "Scan complete (%d objects, %llu bytes)",
+		      tree.nobjects, tree.objmem);
+		discard_bulkstat();
+		if (curr == &tree.root)
+			access_catchup = 0;
+		if (!time_to_ready) {
+			time_to_ready = now_msec() - start_time;
+			notice("Cache ready (%llums after start)",
+			       time_to_ready);
+		}
+		if (curr != &tree.root && cullbuild.oldest < 0) {
+			/* the hot directories have gone cold */
+			debug(1, "Hot scan found nothing");
+			start_scan(1);
+		}
+		else {
+			decant_cull_table();
+		}
+	}
+
+	debug(2, "<-- build_cull_table({%s})", curr->name);
+	put_object(curr);
+	return;
+
+	/* delete unexpected objects that we've found */
+found_unexpected_object:
+	debug(2, "found_unexpected_object");
+
+	destroy_unexpected_object(dirfd(curr->dir), dirent.d_name,
+				  dirent.d_type);
+	goto next;
+}
+
+/*****************************************************************************/
+/*
+ * start a scan to refill the cull table
+ * - the directories that were productive last time are rescanned if a full
+ *   scan has been done recently enough, otherwise the whole tree is walked
+ * - a full walk can be forced with cold
+ */
+static void start_scan(int cold)
+{
+	unsigned long long now = now_msec();
+	int loop;
+
+	if (scan)
+		error("Can't start a scan whilst scanning");
+
+	if (!cold && nhotdirs > 0 &&
+	    now - last_cold_scan < COLD_SCAN_INTERVAL) {
+		/* take a snapshot of the hot list as it'll change as we go */
+		for (loop = 0; loop < nhotdirs; loop++) {
+			hotround[loop] = hotdirs[nhotdirs - 1 - loop];
+			hotround[loop]->usage++;
+		}
+		nhotround = nhotdirs;
+
+		scan = scan_top = hotround[--nhotround];
+		debug(1, "Hot scan of %s", scan->name);
+		return;
+	}
+
+	debug(1, "Cold scan");
+	last_cold_scan = now;
+	access_catchup = access_lost;
+	access_lost = 0;
+	start_bulkstat();
+	tree.root.usage++;
+	scan = scan_top = &tree.root;
+}
+
+/*****************************************************************************/
+/*
+ * note how productive a directory was when it was scanned
+ * - the hot list is kept sorted by number of candidates found, then by most
+ *   recently changed
+ */
+static int hotter(const struct object *a, const struct object *b)
+{
+	if (a->ncandidates != b->ncandidates)
+		return a->ncandidates > b->ncandidates;
+	return a->mtime > b->mtime;
+}
+
+static void update_hotdirs(struct object *dir)
+{
+	int loop;
+
+	/* take it out of the list if it's already there */
+	for (loop = 0; loop < nhotdirs; loop++)
+		if (hotdirs[loop] == dir)
+			break;
+
+	if (loop < nhotdirs) {
+		memmove(&hotdirs[loop], &hotdirs[loop + 1],
+			(nhotdirs - loop - 1) * sizeof(hotdirs[0]));
+		nhotdirs--;
+
+		if (dir->ncandidates == 0) {
+			debug(2, "Cooled %s", dir->name);
+			put_object(dir);
+			return;
+		}
+	}
+	else {
+		/* don't pin more of the tree if we're over budget */
+		if (dir->ncandidates == 0 || over_objmem())
+			return;
+		dir->usage++;
+	}
+
+	/* displace the coldest if the list is full */
+	if (nhotdirs == HOTDIRS_MAX) {
+		if (!hotter(dir, hotdirs[HOTDIRS_MAX - 1])) {
+			put_object(dir);
+			return;
+		}
+		put_object(hotdirs[--nhotdirs]);
+	}
+
+	for (loop = nhotdirs; loop > 0; loop--) {
+		if (!hotter(dir, hotdirs[loop - 1]))
+			break;
+		hotdirs[loop] = hotdirs[loop - 1];
+	}
+
+	hotdirs[loop] = dir;
+	nhotdirs++;
+}
+
+/*****************************************************************************/
+/*
+ * decant cull entries from the build table to the ready table and enable them
+ */
+static void decant_cull_table(void)
+{
+	int loop, n;
+
+	if (scan)
+		error("Can't decant cull table whilst scanning");
+
+	/* if nothing there, scan again in a short while */
+	if (cullbuild.oldest < 0) {
+		signal(SIGALRM, sigalrm);
+		alarm(30);
+		return;
+	}
+
+	/* make room by dropping anything that's going with a directory */
+	drop_covered_entries(&cullready);
+	drop_covered_entries(&cullbuild);
+
+	/* mark the new entries cullable */
+	for (loop = 0; loop <= cullbuild.oldest; loop++) {
+		if (!cullbuild.entries[loop].object->cullable) {
+			cullbuild.entries[loop].object->cullable = 1;
+			ncullable++;
+		}
+	}
+
+	n = cull_table_decant(&cullbuild, &cullready);
+	if (n < 0)
+		error("Cull table overfull on decant");
+
+	debug(1, "Decant %d, %d left", n, cullbuild.oldest + 1);
+
+	for (loop = 0; journal_hdr && loop < n; loop++)
+		journal_event(CFJ_DECANT, cullready.entries[loop].object, 0);
+
+	for (loop = 0; loop < cullready.oldest; loop++)
+		if ((unsigned long)cullready.entries[loop].object >> 28 == 0x6)
+			abort();
+}
+
+/*****************************************************************************/
+/*
+ * get the directory handle for the given directory
+ * - returns -1 if it or one of its parents has been removed
+ */
+static int get_dir_fd(struct object *dir)
+{
+	int fd;
+
+	debug(1, "get_dir_fd(%s)", dir->name);
+
+	fd = object_dir_fd(dir);
+	if (fd == -ENOENT)
+		return -1;
+	if (fd < 0) {
+		errno = -fd;
+		oserror("Failed to open directory");
+	}
+
+	debug(1, "%s to %d", dir->name, fd);
+	return fd;
+}
+
+/*****************************************************************************/
+/*
+ * cull an object
+ * - the space it occupied is added to *_bytes if it was culled
+ * - returns the number of files culled
+ */
+static int cull_object(struct object *object, unsigned long long *_bytes)
+{
+	struct stat64 st;
+	int dirfd, culled = 0;
+
+	if (object->subtree)
+		return cull_subtree(object, _bytes);
+
+	debug(1, "CULL %s", object->name);
+
+	dirfd = get_dir_fd(object->parent);
+	if (dirfd >= 0) {
+		if (fstatat64(dirfd, object->name, &st, 0) < 0) {
+			if (errno != ENOENT)
+				oserror("Failed to re-stat object");
+
+			close(dirfd);
+			goto object_already_gone;
+		}
+
+		apply_access_time(&st);
+
+		if (fchdir(dirfd) < 0)
+			oserror("Failed to change current directory");
+		if (object->atime >= stat_atime(&st) &&
+		    !recently_busy(object)) {
+			if (cull_file(object->name) == 0) {
+				*_bytes += st.st_blocks * 512ULL;
+				culled = 1;
+				note_ghost(object);
+			}
+			else if (errno == EBUSY) {
+				note_busy(object, 1);
+			}
+		}
+
+		close(dirfd);
+	}
+
+object_already_gone:
+	journal_event(culled ? CFJ_CULL : CFJ_DROP, object, culled);
+	put_object(object);
+	return culled;
+}
+
+/*****************************************************************************/
+/*
+ * cull an index directory and everything in it
+ * - the subtree is only known as of the last scan, so we don't cull it if
+ *   something's been added to or removed from the directory since; anything
+ *   in it found used since it went in will have taken it out of the table
+ * - the kernel checks the directory itself isn't in use, but we ask first so
+ *   as not to race with it being looked up
+ * - returns the number of files culled
+ */
+static int cull_subtree(struct object *dir, unsigned long long *_bytes)
+{
+	struct stat64 st;
+	int dirfd, culled = 0;
+
+	debug(1, "CULL subtree %s (%u files)", dir->name, dir->sub_files);
+
+	dirfd = get_dir_fd(dir->parent);
+	if (dirfd >= 0) {
+		if (fstatat64(dirfd, dir->name, &st, 0) < 0) {
+			if (errno != ENOENT)
+				oserror("Failed to re-stat object");
+		}
+		else {
+			if (fchdir(dirfd) < 0)
+				oserror("Failed to change current directory");
+			if (st.st_mtime == dir->mtime &&
+			    !recently_busy(dir)) {
+				if (is_object_in_use(dir->name) ||
+				    cull_file(dir->name) < 0) {
+					note_busy(dir, errno == EBUSY);
+				}
+				else {
+					*_bytes += dir->sub_blocks * 512ULL;
+					culled = dir->sub_files;
+					nsubtree_culls++;
+					note_ghost(dir);
+				}
+			}
+		}
+
+		close(dirfd);
+	}
+
+	journal_event(culled ? CFJ_CULL : CFJ_DROP, dir, culled);
+	dir->subtree = 0;
+	put_object(dir);
+	return culled;
+}
+
+/*****************************************************************************/
+/*
+ * read the free blocks (in the kernel's units) and free files on the cache
+ * filesystem
+ */
+static void read_fs_free(unsigned long long *_bavail, unsigned long long *_ffree)
+{
+	struct statfs sfs;
+
+	if (fstatfs(graveyardfd, &sfs) < 0)
+		oserror("Unable to stat cache filesystem");
+
+	*_bavail = (unsigned long long) sfs.f_bavail * sfs.f_bsize / cache_bsize;
+	*_ffree = sfs.f_ffree;
+}
+
+/*****************************************************************************/
+/*
+ * work out how much we need to cull to get the cache back above brun and frun
+ * - the limits in the state string are in the kernel's units; the free counts
+ *   come straight from the cache filesystem
+ * - anything already culled to the graveyard but not yet reaped is discounted
+ */
+static void work_out_cull_batch(unsigned long long *_bytes,
+				unsigned long long *_files)
+{
+	unsigned long long bavail, ffree, bytes = 0, files = 0;
+
+	read_fs_free(&bavail, &ffree);
+
+	if (bavail < brun)
+		bytes = (brun - bavail) * cache_bsize;
+	if (ffree < frun)
+		files = frun - ffree;
+
+	bytes = bytes > pending_bytes ? bytes - pending_bytes : 0;
+	files = files > pending_files ? files - pending_files : 0;
+
+	debug(1, "Cull deficit %llu bytes, %llu files", bytes, files);
+	*_bytes = bytes;
+	*_files = files;
+}
+
+/*****************************************************************************/
+/*
+ * consider starting a cull
+ * - at most max objects will be culled
+ */
+static void cull_objects(int max)
+{
+	unsigned long long bneed, fneed, bgot = 0, fgot = 0;
+	struct object *object;
+	int n = 0;
+
+	if (ncullable <= 0)
+		error("Cullable object count is inconsistent");
+
+	/* cull a batch of the oldest objects sized to make up the deficit,
+	 * which tapers off as we near brun/frun - but always make progress
+	 * - when preculling there's usually no deficit yet, so the whole of the
+	 *   small batch is taken
+	 */
+	if (cull) {
+		work_out_cull_batch(&bneed, &fneed);
+	} else {
+		bneed = ~0ULL;
+		fneed = ~0ULL;
+	}
+
+	while (cullready.oldest >= 0 &&
+	       cullready.entries[cullready.oldest].object->cullable) {
+		object = cull_table_pop(&cullready);
+
+		/* anything in a directory that's to be culled whole goes when
+		 * the directory does */
+		if (covering_subtree(object)) {
+			journal_event(CFJ_DROP, object, 0);
+			put_object(object);
+			continue;
+		}
+
+		fgot += cull_object(object, &bgot);
+
+		if (++n >= max ||
+		    (bgot >= bneed && fgot >= fneed))
+			break;
+	}
+
+	debug(1, "Culled %d objects (%llu bytes, %llu files)", n, bgot, fgot);
+	nculled_window += n;
+	pending_bytes += bgot;
+	pending_files += fgot;
+
+	/* must start refilling the cull table */
+	if (!scan && cullbuild.oldest <= culltable_size / 2 + 2) {
+		decant_cull_table();
+
+		debug(1, "Refilling cull table");
+		start_scan(0);
+	}
+}
+
+/*****************************************************************************/
+/*
+ * work out the rate at which the free blocks or free files are changing from
+ * the samples by least squares
+ * - returns the change per second
+ */
+static double fill_rate(int files)
+{
+	double mt = 0, mv = 0, num = 0, den = 0, dt, dv;
+	int loop;
+
+#define SAMPLE_VALUE(N) \
+	(double)(files ? fill_samples[N].ffree : fill_samples[N].bavail)
+
+	for (loop = 0; loop < nfill_samples; loop++) {
+		mt += fill_samples[loop].t / 1000.0;
+		mv += SAMPLE_VALUE(loop);
+	}
+	mt /= nfill_samples;
+	mv /= nfill_samples;
+
+	for (loop = 0; loop < nfill_samples; loop++) {
+		dt = fill_samples[loop].t / 1000.0 - mt;
+		dv = SAMPLE_VALUE(loop) - mv;
+		num += dt * dv;
+		den += dt * dt;
+	}
+
+#undef SAMPLE_VALUE
+	return den > 0 ? num / den : 0;
+}
 
-	switch (dirent.d_type) {
-	case DT_UNKNOWN:
-	case DT_DIR:
-	case DT_REG:
-		break;
-	default:
-		oserror("readdir returned unsupported type %d", dirent.d_type);
+/*****************************************************************************/
+/*
+ * see if the trend will take a free count below its cull limit within the
+ * horizon
+ */
+static int will_cross(unsigned long long avail, unsigned long long limit,
+		      double rate)
+{
+	if (avail <= limit || rate >= 0)
+		return 0;
+	return (avail - limit) / -rate <= precull_horizon;
+}
+
+/*****************************************************************************/
+/*
+ * sample the free space and files on the cache and decide whether to start
+ * culling ahead of the kernel asking us to
+ */
+static void sample_fill_rate(void)
+{
+	struct fill_sample *sample;
+	double brate, frate;
+
+	if (nfill_samples == PRECULL_NSAMPLES) {
+		memmove(&fill_samples[0], &fill_samples[1],
+			(PRECULL_NSAMPLES - 1) * sizeof(fill_samples[0]));
+		nfill_samples--;
 	}
 
-	/* delete any funny looking files */
-	if (memchr("IDSJET+@", dirent.d_name[0], 8) == NULL)
-		goto found_unexpected_object;
+	sample = &fill_samples[nfill_samples++];
+	sample->t = now_msec();
+	read_fs_free(&sample->bavail, &sample->ffree);
+	next_fill_sample = sample->t + PRECULL_INTERVAL;
 
-	/* see if this object is already known to us */
-	if (fstatat64(dirfd(curr->dir), dirent.d_name, &st, 0) < 0) {
-		if (errno == ENOENT)
-			goto next;
-		oserror("Failed to stat directory");
+	if (nfill_samples < 3)
+		return;
+
+	brate = fill_rate(0);
+	frate = fill_rate(1);
+
+	precull = will_cross(sample->bavail, bcull, brate) ||
+		will_cross(sample->ffree, fcull, frate);
+
+	debug(1, "Fill rate %.1f blocks/s %.1f files/s%s",
+	      brate, frate, precull ? " - preculling" : "");
+}
+
+/*****************************************************************************/
+/*
+ * find the IO pressure stall information
+ * - the whole system's is used unless we were asked to use that for our own
+ *   cgroup, which needs us to be in one on the unified hierarchy
+ */
+static void open_io_pressure(void)
+{
+	size_t m = 0;
+	FILE *cg;
+	char *line = NULL;
+	int len;
+
+	cg = iothrottle_cgroup ? fopen("/proc/self/cgroup", "r") : NULL;
+	if (cg) {
+		while ((len = getline(&line, &m, cg)) > 0) {
+			if (strncmp(line, "0::/", 4) != 0)
+				continue;
+			if (line[len - 1] == '\n')
+				line[len - 1] = 0;
+
+			snprintf(psi_source, sizeof(psi_source),
+				 "/sys/fs/cgroup%s/io.pressure", line + 3);
+			psifd = open(psi_source, O_RDONLY | O_CLOEXEC);
+			break;
+		}
+		free(line);
+		fclose(cg);
 	}
 
-	if (!S_ISDIR(st.st_mode) &&
-	    (!S_ISREG(st.st_mode) ||
-	     dirent.d_name[0] == 'I' ||
-	     dirent.d_name[0] == 'J' ||
-	     dirent.d_name[0] == '@' ||
-	     dirent.d_name[0] == '+'))
-		goto found_unexpected_object;
+	if (psifd < 0) {
+		strcpy(psi_source, "/proc/pressure/io");
+		psifd = open(psi_source, O_RDONLY | O_CLOEXEC);
+	}
 
-	/* create a representation for this object */
-	child = create_object(curr, dirent.d_name, &st);
-	if (!child && errno == ENOENT)
-		goto next;
+	if (psifd < 0) {
+		if (iothrottle)
+			notice("No IO pressure information (%m), scan not throttled");
+		psi_source[0] = 0;
+	}
+}
 
-	curr->empty = 0;
+/*****************************************************************************/
+/*
+ * find the IO pressure information again after the config has changed, and
+ * start measuring the stall afresh
+ */
+static void reopen_io_pressure(void)
+{
+	if (psifd >= 0)
+		close(psifd);
+	psifd = -1;
+	psi_total = 0;
+	psi_time = 0;
+	psi_stall = 0;
+	next_psi_sample = 0;
+	scan_throttle = SCAN_FULL;
+	scan_delay = 0;
+	scan_resume = 0;
+
+	open_io_pressure();
+	if (psifd >= 0)
+		debug(1, "Taking IO pressure from %s", psi_source);
+}
 
-	if (!child)
-		oserror("Unable to create object");
+/*****************************************************************************/
+/*
+ * sample the IO pressure and adjust the scan throttle
+ * - the stall is worked out from the cumulative "some" stall time rather than
+ *   the kernel's averages, which are too slow to follow
+ */
+static void sample_io_pressure(void)
+{
+	unsigned long long total, now = now_usec();
+	unsigned threshold = iothrottle * 10;
+	char buf[256], *p;
+	ssize_t n;
 
-	/* we consider culling objects at the transition from index object to
-	 * non-index object */
-	switch (child->type) {
-	case OBJTYPE_DATA:
-	case OBJTYPE_SPECIAL:
-		if (!child->new) {
-			/* the child appears to have been retained in the
-			 * culling table already, so we see if it should be
-			 * removed therefrom
-			 */
-			debug(2, "- old child");
+	n = pread(psifd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0) {
+		notice("Unable to read %s, scan not throttled", psi_source);
+		close(psifd);
+		psifd = -1;
+		scan_throttle = SCAN_FULL;
+		scan_delay = 0;
+		return;
+	}
+	buf[n] = 0;
 
-			if (st.st_atime <= child->atime) {
-				/* file on disk hasn't been touched */
-				put_object(child);
-				goto next;
+	p = strstr(buf, "total=");
+	if (strncmp(buf, "some ", 5) != 0 || !p)
+		return;
+	total = strtoull(p + 6, NULL, 10);
+
+	if (psi_time && now > psi_time && total >= psi_total)
+		psi_stall = (total - psi_total) * 1000 / (now - psi_time);
+	psi_total = total;
+	psi_time = now;
+
+	if (psi_stall >= threshold * 2) {
+		scan_throttle = SCAN_PAUSED;
+	}
+	else if (psi_stall >= threshold) {
+		scan_throttle = SCAN_SLOWED;
+		scan_delay = scan_delay ? scan_delay * 2 : SCAN_DELAY_MIN;
+		if (scan_delay > SCAN_DELAY_MAX)
+			scan_delay = SCAN_DELAY_MAX;
+	}
+	else if (psi_stall < threshold / 2) {
+		scan_delay /= 2;
+		if (scan_delay < SCAN_DELAY_MIN)
+			scan_delay = 0;
+		scan_throttle = scan_delay ? SCAN_SLOWED : SCAN_FULL;
+	}
+	else if (scan_throttle == SCAN_PAUSED) {
+		scan_throttle = SCAN_SLOWED;
+	}
+
+	debug(2, "IO stall %u.%u%%, scan %s, delay %ums",
+	      psi_stall / 10, psi_stall % 10,
+	      scan_throttle_names[scan_throttle], scan_delay);
+}
+
+/*****************************************************************************/
+/*
+ * see if the scan should wait for the IO pressure to drop
+ */
+static int scan_held(void)
+{
+	unsigned long long now;
+
+	if (!iothrottle || psifd < 0) {
+		scan_delay = 0;
+		return 0;
+	}
+
+	now = now_msec();
+	if (now >= next_psi_sample) {
+		next_psi_sample = now + PSI_INTERVAL;
+		sample_io_pressure();
+	}
+
+	/* don't let culling starve */
+	scan_urgent = cull && cullready.oldest + 1 < (int)culltable_size / 8;
+	if (scan_urgent)
+		return 0;
+
+	if (scan_throttle == SCAN_PAUSED) {
+		scan_resume = next_psi_sample;
+		return 1;
+	}
+
+	return now < scan_resume;
+}
+
+/*****************************************************************************/
+/*
+ * add a data object to the inode hash so that access events can find it
+ */
+static void hash_object(struct object *object)
+{
+	struct object **bucket;
+
+	if (fanfd < 0)
+		return;
+
+	bucket = &access_hash[object->ino & (ACCESS_HASH_SIZE - 1)];
+	object->hnext = *bucket;
+	*bucket = object;
+}
+
+/*****************************************************************************/
+/*
+ * remove an object from the inode hash
+ */
+static void unhash_object(struct object *object)
+{
+	struct object **pp;
+
+	if (fanfd < 0)
+		return;
+
+	for (pp = &access_hash[object->ino & (ACCESS_HASH_SIZE - 1)];
+	     *pp;
+	     pp = &(*pp)->hnext) {
+		if (*pp == object) {
+			*pp = object->hnext;
+			return;
+		}
+	}
+}
+
+/*****************************************************************************/
+/*
+ * start tracking accesses to files on the cache filesystem
+ * - if fanotify isn't available, we just rely on rescanning
+ */
+static void open_access_tracking(void)
+{
+	fanfd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_FID |
+			      FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY);
+	if (fanfd < 0) {
+		notice("Unable to track accesses with fanotify: %m");
+		return;
+	}
+
+	if (fanotify_mark(fanfd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			  FAN_ACCESS | FAN_OPEN | FAN_MODIFY,
+			  dirfd(tree.root.dir), NULL) < 0) {
+		notice("Unable to mark cache filesystem with fanotify: %m");
+		close(fanfd);
+		fanfd = -1;
+		return;
+	}
+
+	debug(1, "Tracking accesses with fanotify");
+}
+
+/*****************************************************************************/
+/*
+ * put all the data objects in a directory's subtree into the inode hash
+ */
+static void hash_subtree(struct object *dir)
+{
+	struct object *child;
+
+	for (child = dir->children; child; child = child->next) {
+		if (child->type == OBJTYPE_DATA ||
+		    child->type == OBJTYPE_SPECIAL)
+			hash_object(child);
+		else
+			hash_subtree(child);
+	}
+}
+
+/*****************************************************************************/
+/*
+ * start tracking accesses again after a reload
+ * - the objects we already know of have to be hashed for their accesses to be
+ *   seen, and as anything could have been used whilst we weren't looking,
+ *   they have to be restatted by the next cold scan
+ */
+static void reopen_access_tracking(void)
+{
+	open_access_tracking();
+	if (fanfd < 0)
+		return;
+
+	hash_subtree(&tree.root);
+	access_lost = 1;
+}
+
+/*****************************************************************************/
+/*
+ * stop tracking accesses
+ * - the inode hash is emptied as objects aren't unhashed when they're
+ *   released whilst we aren't tracking
+ */
+static void close_access_tracking(void)
+{
+	close(fanfd);
+	fanfd = -1;
+	memset(access_hash, 0, sizeof(access_hash));
+	debug(1, "No longer tracking accesses");
+}
+
+/*****************************************************************************/
+/*
+ * work out the inode number from a file handle reported by fanotify
+ * - the common handle types lead with the inode number; for others we have to
+ *   ask the kernel
+ * - returns 0 if the file has gone away
+ */
+static ino_t file_handle_to_ino(struct file_handle *fh)
+{
+	struct stat64 st;
+	uint32_t ino32;
+	uint64_t ino64;
+	int fd;
+
+	switch (fh->handle_type) {
+	case 0x01: /* FILEID_INO32_GEN */
+	case 0x02: /* FILEID_INO32_GEN_PARENT */
+		if (fh->handle_bytes < sizeof(ino32))
+			break;
+		memcpy(&ino32, fh->f_handle, sizeof(ino32));
+		return ino32;
+
+	case 0x81: /* XFS 64-bit inode handles */
+	case 0x82:
+		if (fh->handle_bytes < sizeof(ino64))
+			break;
+		memcpy(&ino64, fh->f_handle, sizeof(ino64));
+		return ino64;
+
+	default:
+		break;
+	}
+
+	fd = open_by_handle_at(dirfd(tree.root.dir), fh, O_PATH);
+	if (fd < 0) {
+		if (errno == ESTALE || errno == ENOENT)
+			return 0;
+		oserror("Unable to open file by handle");
+	}
+
+	if (fstat64(fd, &st) < 0)
+		oserror("Unable to stat file by handle");
+	close(fd);
+	return st.st_ino;
+}
+
+/*****************************************************************************/
+/*
+ * note an access to a file on the cache filesystem
+ * - if we're tracking the object, it's no longer a candidate for culling
+ */
+static void note_access(ino_t ino)
+{
+	struct access_time *at;
+	struct object *object, *p;
+
+	at = &access_times[ino & (ACCESS_HASH_SIZE - 1)];
+	at->ino = ino;
+	at->atime = now_nsec();
+
+	for (object = access_hash[ino & (ACCESS_HASH_SIZE - 1)];
+	     object;
+	     object = object->hnext) {
+		if (object->ino != ino)
+			continue;
+
+		debug(2, "Accessed %s", object->name);
+		object->atime = at->atime;
+
+		/* nor may any directory containing it be culled whole */
+		for (p = object->parent; p; p = p->parent)
+			if (p->subtree)
+				remove_from_cull_table(p);
+
+		/* the object may go away when the table lets go of it */
+		remove_from_cull_table(object);
+		return;
+	}
+}
+
+/*****************************************************************************/
+/*
+ * bring forward the atime in a file's stat details if we've seen it accessed
+ * more recently than the backing filesystem records
+ */
+static void apply_access_time(struct stat64 *st)
+{
+	struct access_time *at;
+
+	if (fanfd < 0)
+		return;
+
+	at = &access_times[st->st_ino & (ACCESS_HASH_SIZE - 1)];
+	if (at->ino == st->st_ino && at->atime > stat_atime(st)) {
+		st->st_atim.tv_sec = at->atime / NSEC_PER_SEC;
+		st->st_atim.tv_nsec = at->atime % NSEC_PER_SEC;
+	}
+}
+
+/*****************************************************************************/
+/*
+ * read and process the pending access events
+ */
+static void read_access_events(void)
+{
+	struct fanotify_event_metadata *md;
+	struct fanotify_event_info_fid *fid;
+	char buffer[8192] __attribute__((aligned(8)));
+	ssize_t len;
+	ino_t ino;
+
+	for (;;) {
+		len = read(fanfd, buffer, sizeof(buffer));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			oserror("Unable to read access events");
+		}
+
+		for (md = (struct fanotify_event_metadata *)buffer;
+		     FAN_EVENT_OK(md, len);
+		     md = FAN_EVENT_NEXT(md, len)) {
+			if (md->mask & FAN_Q_OVERFLOW) {
+				/* we'll have to rescan everything to catch
+				 * up */
+				notice("Access events lost");
+				access_lost = 1;
+				continue;
 			}
 
-			for (loop = 0; loop <= oldest_ready; loop++)
-				if (cullready[loop] == child)
-					break;
+			fid = (struct fanotify_event_info_fid *)(md + 1);
+			if ((char *)(fid + 1) > (char *)md + md->event_len ||
+			    fid->hdr.info_type != FAN_EVENT_INFO_TYPE_FID)
+				continue;
 
-			if (loop == oldest_ready) {
-				/* child was oldest object */
-				cullready[oldest_ready] = (void *)(0x6b000000 | __LINE__);
-				oldest_ready--;
-				put_object(child);
-				goto removed;
+			ino = file_handle_to_ino((struct file_handle *)fid->handle);
+			if (ino)
+				note_access(ino);
+		}
+	}
+}
+
+/*****************************************************************************/
+/*
+ * allocate memory that's shared with the processes we're about to fork
+ */
+static void *map_shared(size_t size)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		oserror("Unable to allocate shared memory");
+	return p;
+}
+
+/*****************************************************************************/
+/*
+ * open a directory in the cache without disturbing its atime if we can
+ */
+static int open_walk_dir(int dirfd, const char *name)
+{
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOATIME);
+	if (fd < 0 && errno == EPERM)
+		fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+	return fd;
+}
+
+/*****************************************************************************/
+/*
+ * add a unit of work to the list for the walkers
+ */
+static void add_walk_unit(const char *path, int volume, int depth)
+{
+	struct walk_unit *unit;
+
+	if (nwalk_units >= maxwalk_units) {
+		maxwalk_units = maxwalk_units ? maxwalk_units * 2 : 64;
+		walk_units = realloc(walk_units,
+				     maxwalk_units * sizeof(walk_units[0]));
+		if (!walk_units)
+			oserror("Unable to alloc walk units");
+	}
+
+	unit = &walk_units[nwalk_units++];
+	unit->path = strdup(path);
+	if (!unit->path)
+		oserror("Unable to alloc walk units");
+	unit->volume = volume;
+	unit->depth = depth;
+	unit->shallow = 0;
+	unit->grave = 0;
+}
+
+/*****************************************************************************/
+/*
+ * note an index volume
+ */
+static int add_walk_volume(const char *path)
+{
+	if (nwalk_volumes % 64 == 0) {
+		walk_volumes = realloc(walk_volumes, (nwalk_volumes + 64) *
+				       sizeof(walk_volumes[0]));
+		if (!walk_volumes)
+			oserror("Unable to alloc volume list");
+	}
+
+	walk_volumes[nwalk_volumes] = strdup(path);
+	if (!walk_volumes[nwalk_volumes])
+		oserror("Unable to alloc volume list");
+	return nwalk_volumes++;
+}
+
+/*****************************************************************************/
+/*
+ * split the cache tree into units of work for the walkers
+ * - the cache directory and any fan-out directories above the index volumes
+ *   are always split so that every volume is a unit of its own
+ * - the first index directory on the way down is taken to be the volume
+ * - the directories within volumes are split, breadth first, until there are
+ *   enough units to keep all the walkers busy
+ */
+static void split_walk_units(int rootfd, unsigned jobs)
+{
+	struct dirent *de;
+	struct stat64 st;
+	char path[PATH_MAX];
+	unsigned loop;
+	DIR *dir;
+	int fd, volume;
+
+	add_walk_unit("cache", -1, 0);
+
+	for (loop = 0; loop < nwalk_units; loop++) {
+		if (walk_units[loop].grave ||
+		    walk_units[loop].depth >= WALK_SPLIT_DEPTH ||
+		    (walk_units[loop].volume >= 0 &&
+		     nwalk_units >= jobs * 4))
+			continue;
+
+		fd = open_walk_dir(rootfd, walk_units[loop].path);
+		if (fd < 0) {
+			if (errno == ENOENT && walk_units[loop].depth > 0)
+				continue;
+			oserror("Unable to open %s", walk_units[loop].path);
+		}
+
+		dir = fdopendir(fd);
+		if (!dir)
+			oserror("Unable to open %s", walk_units[loop].path);
+
+		walk_units[loop].shallow = 1;
+		while (errno = 0, (de = readdir(dir))) {
+			/* data objects are left to the walker, even if they're
+			 * directories */
+			if (de->d_name[0] == '.' ||
+			    unexpected_name(de->d_name) ||
+			    strchr("DEST", de->d_name[0]))
+				continue;
+
+			if (de->d_type == DT_UNKNOWN) {
+				if (fstatat64(fd, de->d_name, &st,
+					      AT_SYMLINK_NOFOLLOW) < 0)
+					continue;
+				if (!S_ISDIR(st.st_mode))
+					continue;
 			}
-			else if (loop < oldest_ready) {
-				/* child was somewhere in between */
-				memmove(&cullready[loop],
-					&cullready[loop + 1],
-					(oldest_ready - loop) * sizeof(cullready[0]));
-				cullready[oldest_ready] = (void *)(0x6b000000 | __LINE__);
-				oldest_ready--;
-				put_object(child);
-				goto removed;
+			else if (de->d_type != DT_DIR) {
+				continue;
 			}
 
-			for (loop = 0; loop <= oldest_build; loop++)
-				if (cullbuild[loop] == child)
-					break;
+			snprintf(path, sizeof(path), "%s/%s",
+				 walk_units[loop].path, de->d_name);
 
-			if (loop == oldest_build) {
-				/* child was oldest object */
-				cullbuild[oldest_build] = (void *)(0x6b000000 | __LINE__);
-				oldest_build--;
-				put_object(child);
-			}
-			else if (loop < oldest_build) {
-				/* child was somewhere in between */
-				memmove(&cullbuild[loop],
-					&cullbuild[loop + 1],
-					(oldest_build - loop) * sizeof(cullbuild[0]));
-				cullbuild[oldest_build] = (void *)(0x6b000000 | __LINE__);
-				oldest_build--;
-				put_object(child);
-			}
+			volume = walk_units[loop].volume;
+			if (volume < 0 && strchr("IJ", de->d_name[0]))
+				volume = add_walk_volume(path + 6);
 
-		removed:
-			;
+			add_walk_unit(path, volume, walk_units[loop].depth + 1);
 		}
 
-		/* add objects that aren't in use to the cull table */
-		if (!is_object_in_use(dirent.d_name)) {
-			debug(2, "- insert");
-			child->new = 0;
-			insert_into_cull_table(child);
+		if (errno != 0)
+			oserror("Unable to read %s", walk_units[loop].path);
+		closedir(dir);
+	}
+}
+
+/*****************************************************************************/
+/*
+ * fork the walkers and have them take units of work until there are none left
+ */
+static void run_walkers(int rootfd, unsigned jobs,
+			void (*walk)(int rootfd, struct walk_unit *unit,
+				     unsigned walker))
+{
+	unsigned *next, loop, i;
+	pid_t pid;
+	int status, failed = 0;
+
+	next = map_shared(sizeof(*next));
+
+	for (loop = 0; loop < jobs; loop++) {
+		pid = fork();
+		if (pid < 0)
+			oserror("Unable to fork walker");
+
+		if (pid == 0) {
+			while (i = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED),
+			       i < nwalk_units)
+				walk(rootfd, &walk_units[i], loop);
+			_exit(0);
 		}
-		put_object(child);
-		goto next;
+	}
 
-		/* investigate all index and index-intermediate directories */
-	case OBJTYPE_INDEX:
-	case OBJTYPE_INTERMEDIATE:
-		debug(2, "- descend");
+	for (loop = 0; loop < jobs; loop++) {
+		if (wait(&status) < 0)
+			oserror("Unable to wait for walkers");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
 
-		child->new = 0;
-		scan = child;
+	munmap(next, sizeof(*next));
+	if (failed)
+		error("Walker failed");
+}
 
-		debug(2, "<-- build_cull_table({%s})", curr->name);
-		return;
+/*****************************************************************************/
+/*
+ * work out which log2 bin a value goes in
+ */
+static int analysis_bin(unsigned long long value)
+{
+	int bin = 0;
 
-	default:
-		error("Unexpected type");
+	while (value && bin < ANALYSIS_BINS - 1) {
+		value >>= 1;
+		bin++;
 	}
+	return bin;
+}
 
-	/* we've finished reading a directory - see if we can cull it */
-dir_read_complete:
-	debug(2, "dir_read_complete: u=%d e=%d %s",
-	      curr->usage, curr->empty, curr->name);
+/*****************************************************************************/
+/*
+ * gather the statistics on a directory and, unless the unit is shallow,
+ * everything below it
+ * - the directory is read and statted in inode order as in the scanner, but
+ *   nothing is changed
+ */
+static void analyse_dir(int dirfd, const char *name, int volume, int shallow,
+			struct analysis *a)
+{
+	struct volume_totals *v = volume >= 0 ? &volume_totals[volume] : NULL;
+	struct dirlist_entry *ent;
+	struct object *dir;
+	struct stat64 st;
+	const char *ename;
+	long long age;
+	int fd;
 
-	if (curr->dir) {
-		if (curr != &root) {
-			closedir(curr->dir);
-			curr->dir = NULL;
-			nopendir--;
-		}
-		else {
-			rewinddir(curr->dir);
-		}
+	fd = open_walk_dir(dirfd, name);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return;
+		oserror("Unable to open directory %s", name);
 	}
 
-	if (curr->usage == 1 && curr->empty) {
-		/* attempt to cull unpinned empty intermediate and index
-		 * objects */
-		if (fchdir(dirfd(curr->parent->dir)) < 0)
-			oserror("Failed to change current directory");
+	dir = calloc(1, sizeof(struct object));
+	if (!dir)
+		oserror("Unable to alloc object");
+	dir->dir = fdopendir(fd);
+	if (!dir->dir)
+		oserror("Unable to open directory %s", name);
+
+	if (fill_dirlist(dir) < 0)
+		goto out;
+
+	for (; dir->list->pos < dir->list->nentries; dir->list->pos++) {
+		ent = &dir->list->entries[dir->list->pos];
+		ename = dir->list->names + ent->name;
+
+		if (unexpected_name(ename)) {
+			a->unexpected_names++;
+			if (v)
+				__atomic_fetch_add(&v->unexpected, 1,
+						   __ATOMIC_RELAXED);
+			continue;
+		}
 
-		switch (curr->type) {
-		case OBJTYPE_INDEX:
-			cull_file(curr->name);
-			break;
+		if (fstatat64(fd, ename, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			if (errno == ENOENT)
+				continue;
+			oserror("Unable to stat %s", ename);
+		}
 
-		case OBJTYPE_INTERMEDIATE:
-			unlinkat(dirfd(curr->parent->dir), curr->name,
-				 AT_REMOVEDIR);
-			break;
+		if (unexpected_type(ename, st.st_mode)) {
+			a->unexpected_types++;
+			if (v)
+				__atomic_fetch_add(&v->unexpected, 1,
+						   __ATOMIC_RELAXED);
+			continue;
+		}
 
-		default:
-			break;
+		/* data objects may be directories too, but they're counted
+		 * by what they are rather than what they contain */
+		if (ename[0] != 'D' && ename[0] != 'E' &&
+		    ename[0] != 'S' && ename[0] != 'T') {
+			a->dirs++;
+			if (v)
+				__atomic_fetch_add(&v->dirs, 1,
+						   __ATOMIC_RELAXED);
+			if (!shallow)
+				analyse_dir(fd, ename, volume, 0, a);
+			continue;
 		}
-	}
 
-	scan = curr->parent;
-	if (!scan) {
-		debug(1, "Scan complete");
-		decant_cull_table();
+		if (ename[0] == 'D' || ename[0] == 'E')
+			a->data_files++;
+		else
+			a->special_files++;
+		a->blocks += st.st_blocks;
+
+		age = analysis_time - st.st_atime;
+		a->age[analysis_bin(age > 0 ? age : 0)].files++;
+		a->age[analysis_bin(age > 0 ? age : 0)].blocks += st.st_blocks;
+		a->size[analysis_bin(st.st_blocks)].files++;
+		a->size[analysis_bin(st.st_blocks)].blocks += st.st_blocks;
+
+		if (v) {
+			long long newest = v->newest_atime;
+
+			__atomic_fetch_add(&v->files, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&v->blocks, st.st_blocks,
+					   __ATOMIC_RELAXED);
+			while (st.st_atime > newest &&
+			       !__atomic_compare_exchange_n(
+				       &v->newest_atime, &newest,
+				       (long long) st.st_atime, 0,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+		}
 	}
 
-	debug(2, "<-- build_cull_table({%s})", curr->name);
-	put_object(curr);
-	return;
+out:
+	dirlist_free(dir);
+	closedir(dir->dir);
+	free(dir);
+}
 
-	/* delete unexpected objects that we've found */
-found_unexpected_object:
-	debug(2, "found_unexpected_object");
+/*****************************************************************************/
+/*
+ * analyse a unit of work
+ */
+static void analyse_unit(int rootfd, struct walk_unit *unit, unsigned walker)
+{
+	analyse_dir(rootfd, unit->path, unit->volume, unit->shallow,
+		    &analyses[walker]);
+}
 
-	destroy_unexpected_object(curr, &dirent);
-	goto next;
+/*****************************************************************************/
+/*
+ * print a string as JSON
+ */
+static void json_string(const char *p)
+{
+	putchar('"');
+	for (; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if ((unsigned char)*p < 0x20)
+			printf("\\u%04x", (unsigned char)*p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
 }
 
 /*****************************************************************************/
 /*
- * decant cull entries from the build table to the ready table and enable them
+ * print a set of log2 bins as JSON, leaving out the empty ones
  */
-static void decant_cull_table(void)
+static void json_bins(const char *label, const struct analysis_bin *bins)
 {
-	int loop, space, avail, copy, leave, n;
+	const char *sep = "";
+	int loop;
 
-	if (scan)
-		error("Can't decant cull table whilst scanning");
+	printf("  \"%s\": [", label);
+	for (loop = 0; loop < ANALYSIS_BINS; loop++) {
+		if (!bins[loop].files)
+			continue;
+		printf("%s\n    { \"lt\": %llu, \"files\": %llu, \"blocks\": %llu }",
+		       sep, 1ULL << loop, bins[loop].files, bins[loop].blocks);
+		sep = ",";
+	}
+	printf("\n  ],\n");
+}
 
-	/* if nothing there, scan again in a short while */
-	if (oldest_build < 0) {
-		signal(SIGALRM, sigalrm);
-		alarm(30);
-		return;
+/*****************************************************************************/
+/*
+ * analyse a cache without binding it or changing anything in it, and print
+ * the results as JSON
+ */
+static void analyse_cache(const char *cachedir, unsigned jobs)
+{
+	unsigned long long graves = 0, grave_blocks = 0, start = now_msec();
+	struct analysis total;
+	struct dirent *de;
+	struct stat64 st;
+	unsigned loop, bin;
+	DIR *dir;
+	int rootfd, fd;
+
+	rootfd = open(cachedir, O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0)
+		oserror("Unable to open cache directory %s", cachedir);
+
+	/* there's nothing else to give time to */
+	slice_end = ~0ULL;
+
+	analysis_time = time(NULL);
+	split_walk_units(rootfd, jobs);
+
+	analyses = map_shared(jobs * sizeof(analyses[0]));
+	volume_totals = map_shared((nwalk_volumes + 1) *
+				   sizeof(volume_totals[0]));
+
+	run_walkers(rootfd, jobs, analyse_unit);
+
+	/* the graves aren't explored, just counted */
+	fd = open_walk_dir(rootfd, "graveyard");
+	if (fd >= 0) {
+		dir = fdopendir(fd);
+		if (!dir)
+			oserror("Unable to open graveyard");
+		while ((de = readdir(dir))) {
+			if (de->d_name[0] == '.')
+				continue;
+			graves++;
+			if (fstatat64(fd, de->d_name, &st,
+				      AT_SYMLINK_NOFOLLOW) == 0)
+				grave_blocks += st.st_blocks;
+		}
+		closedir(dir);
 	}
 
-	/* mark the new entries cullable */
-	for (loop = 0; loop <= oldest_build; loop++) {
-		if (!cullbuild[loop]->cullable) {
-			cullbuild[loop]->cullable = 1;
-			ncullable++;
+	memset(&total, 0, sizeof(total));
+	for (loop = 0; loop < jobs; loop++) {
+		total.dirs += analyses[loop].dirs;
+		total.data_files += analyses[loop].data_files;
+		total.special_files += analyses[loop].special_files;
+		total.blocks += analyses[loop].blocks;
+		total.unexpected_names += analyses[loop].unexpected_names;
+		total.unexpected_types += analyses[loop].unexpected_types;
+		for (bin = 0; bin < ANALYSIS_BINS; bin++) {
+			total.age[bin].files += analyses[loop].age[bin].files;
+			total.age[bin].blocks += analyses[loop].age[bin].blocks;
+			total.size[bin].files += analyses[loop].size[bin].files;
+			total.size[bin].blocks += analyses[loop].size[bin].blocks;
 		}
 	}
 
-	/* if the ready table is empty, copy the whole lot across */
-	if (oldest_ready == -1) {
-		copy = oldest_build + 1;
+	printf("{\n  \"cache\": ");
+	json_string(cachedir);
+	printf(",\n  \"time\": %lld,\n", (long long) analysis_time);
+	printf("  \"jobs\": %u,\n  \"units\": %u,\n", jobs, nwalk_units);
+	printf("  \"elapsed_ms\": %llu,\n", now_msec() - start);
+	printf("  \"totals\": { \"dirs\": %llu, \"data_files\": %llu,"
+	       " \"special_files\": %llu, \"blocks\": %llu,"
+	       " \"unexpected_names\": %llu, \"unexpected_types\": %llu,"
+	       " \"graves\": %llu, \"grave_blocks\": %llu },\n",
+	       total.dirs, total.data_files, total.special_files, total.blocks,
+	       total.unexpected_names, total.unexpected_types,
+	       graves, grave_blocks);
+	json_bins("age_seconds", total.age);
+	json_bins("size_blocks", total.size);
+
+	printf("  \"volumes\": [");
+	for (loop = 0; loop < nwalk_volumes; loop++) {
+		printf("%s\n    { \"name\": ", loop ? "," : "");
+		json_string(walk_volumes[loop]);
+		printf(", \"dirs\": %llu, \"files\": %llu, \"blocks\": %llu,"
+		       " \"unexpected\": %llu, \"newest_atime\": %lld }",
+		       volume_totals[loop].dirs, volume_totals[loop].files,
+		       volume_totals[loop].blocks,
+		       volume_totals[loop].unexpected,
+		       volume_totals[loop].newest_atime);
+	}
+	printf("\n  ]\n}\n");
+
+	exit(0);
+}
 
-		debug(1, "Decant (all %d)", copy);
+/*****************************************************************************/
+/*
+ * see if one object found by the sweep should be culled after another
+ */
+static int sweep_newer(const struct sweep_candidate *a,
+		       const struct sweep_candidate *b)
+{
+	if (a->atime != b->atime)
+		return a->atime > b->atime;
+	return a->ino > b->ino;
+}
 
-		n = copy * sizeof(cullready[0]);
-		memcpy(cullready, cullbuild, n);
-		memset(cullbuild, 0x6e, n);
-		oldest_ready = oldest_build;
-		oldest_build = -1;
-		goto check;
-	}
+static int sweep_candidate_cmp(const void *_a, const void *_b)
+{
+	const struct sweep_candidate *a = *(const struct sweep_candidate **)_a;
+	const struct sweep_candidate *b = *(const struct sweep_candidate **)_b;
 
-	/* decant some of the build table if there's space */
-	space = culltable_size - (oldest_ready + 1);
-	if (space <= 0) {
-		if (space < 0)
-			error("Less than zero space in ready table");
-		goto check;
+	return sweep_newer(a, b) - sweep_newer(b, a);
+}
+
+/*****************************************************************************/
+/*
+ * squeeze the paths of the candidates still in a walker's heap together to
+ * get rid of those of the candidates that have been displaced
+ */
+static void compact_sweep_names(struct sweep *sw)
+{
+	unsigned loop, len, size = 0;
+	char *names;
+
+	names = malloc(sw->namesize);
+	if (!names)
+		oserror("Unable to alloc sweep names");
+
+	for (loop = 0; loop < sw->ncandidates; loop++) {
+		len = strlen(sw->names + sw->candidates[loop].path) + 1;
+		memcpy(names + size, sw->names + sw->candidates[loop].path, len);
+		sw->candidates[loop].path = size;
+		size += len;
 	}
 
-	/* work out how much of the build table we can copy */
-	copy = avail = oldest_build + 1;
-	if (copy > space)
-		copy = space;
-	leave = avail - copy;
+	memcpy(sw->names, names, size);
+	sw->namesize = size;
+	sw->namelive = size;
+	free(names);
+}
+
+/*****************************************************************************/
+/*
+ * keep an object found by the sweep as a candidate for culling if there's
+ * room or if it's older than the newest candidate the walker has
+ * - the path is relative to the cache directory
+ */
+static void add_sweep_candidate(struct sweep *sw, long long atime, ino_t ino,
+				const char *dirpath, const char *name)
+{
+	struct sweep_candidate cand, *c = sw->candidates, tmp;
+	unsigned i, child, len, dlen;
 
-	debug(1, "Decant (%d/%d to %d)", copy, avail, space);
+	cand.atime = atime;
+	cand.ino = ino;
+	cand.walker = sw - sweeps;
 
-	/* make a hole in the ready table transfer "copy" elements from the end
-	 * of cullbuild (oldest) to the beginning of cullready (youngest)
-	 */
-	n = oldest_ready + 1;
-	memmove(&cullready[copy], &cullready[0], n * sizeof(cullready[0]));
-	oldest_ready += copy;
+	if (sw->ncandidates >= sweep_max && !sweep_newer(&c[0], &cand))
+		return;
 
-	memcpy(&cullready[0], &cullbuild[leave], copy * sizeof(cullready[0]));
-	memset(&cullbuild[leave], 0x6b, copy * sizeof(cullbuild[0]));
-	oldest_build = leave - 1;
+	/* find room for the path, compacting the names only if that would get
+	 * back at least a quarter of the buffer so that we don't keep copying
+	 * a nearly full buffer for the sake of a few bytes */
+	dlen = strlen(dirpath);
+	len = dlen + (dlen ? 1 : 0) + strlen(name) + 1;
+	if (sw->namesize + len > sweep_names_max) {
+		if (sw->namesize - sw->namelive >= sweep_names_max / 4)
+			compact_sweep_names(sw);
+		if (sw->namesize + len > sweep_names_max) {
+			sw->dropped++;
+			return;
+		}
+	}
 
-	if (copy + leave > culltable_size)
-		error("Scan table exceeded (%d+%d)", copy, leave);
+	cand.path = sw->namesize;
+	sprintf(sw->names + sw->namesize, "%s%s%s",
+		dirpath, dlen ? "/" : "", name);
+	sw->namesize += len;
+	sw->namelive += len;
+
+	/* displace the newest candidate if the heap is full */
+	if (sw->ncandidates >= sweep_max) {
+		sw->namelive -= strlen(sw->names + c[0].path) + 1;
+		c[0] = c[--sw->ncandidates];
+		for (i = 0;; i = child) {
+			child = i * 2 + 1;
+			if (child >= sw->ncandidates)
+				break;
+			if (child + 1 < sw->ncandidates &&
+			    sweep_newer(&c[child + 1], &c[child]))
+				child++;
+			if (!sweep_newer(&c[child], &c[i]))
+				break;
+			tmp = c[i];
+			c[i] = c[child];
+			c[child] = tmp;
+		}
+	}
 
-check:
-	for (loop = 0; loop < oldest_ready; loop++)
-		if (((long)cullready[loop] & 0xf0000000) == 0x60000000)
-			abort();
+	for (i = sw->ncandidates++; i > 0; i = (i - 1) / 2) {
+		if (!sweep_newer(&cand, &c[(i - 1) / 2]))
+			break;
+		c[i] = c[(i - 1) / 2];
+	}
+	c[i] = cand;
 }
 
 /*****************************************************************************/
 /*
- * get the directory handle for the given directory
+ * sweep a directory and, unless the unit is shallow, everything below it
+ * - unexpected objects are destroyed as the scanner would
+ * - path holds the directory's path relative to the cache directory and is
+ *   extended in place as we descend
  */
-static int get_dir_fd(struct object *dir)
+static void sweep_dir(int dirfd, const char *name, char *path, int shallow,
+		      struct sweep *sw)
 {
-	int parentfd, fd;
+	struct dirlist_entry *ent;
+	struct object *dir;
+	struct stat64 st;
+	const char *ename;
+	size_t plen = strlen(path);
+	int fd;
 
-	debug(1, "get_dir_fd(%s)", dir->name);
+	fd = open_walk_dir(dirfd, name);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return;
+		oserror("Unable to open directory %s", name);
+	}
 
-	if (dir->dir) {
-		fd = dup(dirfd(dir->dir));
-		if (fd < 0)
-			oserror("Failed to dup fd");
-		debug(1, "cache fd to %d", fd);
-		return fd;
+	dir = calloc(1, sizeof(struct object));
+	if (!dir)
+		oserror("Unable to alloc object");
+	dir->dir = fdopendir(fd);
+	if (!dir->dir)
+		oserror("Unable to open directory %s", name);
+
+	if (fill_dirlist(dir) < 0)
+		goto out;
+
+	for (; dir->list->pos < dir->list->nentries; dir->list->pos++) {
+		ent = &dir->list->entries[dir->list->pos];
+		ename = dir->list->names + ent->name;
+
+		if (unexpected_name(ename)) {
+			destroy_unexpected_object(fd, ename, ent->type);
+			sw->unexpected++;
+			continue;
+		}
+
+		if (fstatat64(fd, ename, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			if (errno == ENOENT)
+				continue;
+			oserror("Unable to stat %s", ename);
+		}
+
+		if (unexpected_type(ename, st.st_mode)) {
+			destroy_unexpected_object(fd, ename, DT_REG);
+			sw->unexpected++;
+			continue;
+		}
+
+		if (ename[0] != 'D' && ename[0] != 'E' &&
+		    ename[0] != 'S' && ename[0] != 'T') {
+			sw->dirs++;
+			if (!shallow &&
+			    plen + 1 + strlen(ename) < PATH_MAX) {
+				sprintf(path + plen, "%s%s",
+					plen ? "/" : "", ename);
+				sweep_dir(fd, ename, path, 0, sw);
+				path[plen] = 0;
+			}
+			continue;
+		}
+
+		sw->files++;
+		if (sw->candidates)
+			add_sweep_candidate(sw, stat_atime(&st), st.st_ino,
+					    path, ename);
 	}
 
-	parentfd = get_dir_fd(dir->parent);
+out:
+	dirlist_free(dir);
+	closedir(dir->dir);
+	free(dir);
+}
 
-	fd = openat(parentfd, dir->name, O_DIRECTORY);
-	if (fd < 0 && errno != ENOENT)
-		oserror("Failed to open directory");
+/*****************************************************************************/
+/*
+ * sweep a unit of work, be it part of the cache or a grave
+ */
+static void sweep_unit(int rootfd, struct walk_unit *unit, unsigned walker)
+{
+	struct sweep *sw = &sweeps[walker];
+	char path[PATH_MAX];
+	int ret;
+
+	/* the journal can't be written from several processes at once */
+	journal_hdr = NULL;
+
+	if (unit->grave) {
+		ret = reaper_reap_grave(&reaper, rootfd, unit->path);
+		if (ret < 0) {
+			errno = -ret;
+			oserror("Unable to reap %s", unit->path);
+		}
+		sw->graves++;
+		return;
+	}
 
-	/* return parent fd or -1 if ENOENT */
-	debug(1, "<%d>/%s to %d", parentfd, dir->name, fd);
-	close(parentfd);
-	return fd;
+	/* paths are kept relative to the cache directory */
+	strcpy(path, unit->path[5] ? unit->path + 6 : "");
+	sweep_dir(rootfd, unit->path, path, unit->shallow, sw);
 }
 
 /*****************************************************************************/
 /*
- * cull an object
+ * put an object found by the sweep into the cull table, creating
+ * representations of the directories on the way to it
+ * - the object is restatted and checked for being in use as the scanner would
  */
-static void cull_object(struct object *object)
+static void sweep_insert(const char *path)
 {
+	struct object *dir = &tree.root, *child;
 	struct stat64 st;
-	int dirfd;
+	char buf[PATH_MAX], *name, *sp;
+	int fd, busy;
+
+	strcpy(buf, path);
+	tree.root.usage++;
+
+	for (name = buf;; name = sp + 1) {
+		sp = strchr(name, '/');
+		if (sp)
+			*sp = 0;
+
+		/* directories we've already been down are known */
+		for (child = dir->children; sp && child; child = child->next)
+			if (strcmp(child->name, name) == 0)
+				break;
+		if (sp && child) {
+			child->usage++;
+			put_object(dir);
+			dir = child;
+			continue;
+		}
 
-	debug(1, "CULL %s", object->name);
+		fd = get_dir_fd(dir);
+		if (fd < 0)
+			break;
 
-	dirfd = get_dir_fd(object->parent);
-	if (dirfd >= 0) {
-		if (fstatat64(dirfd, object->name, &st, 0) < 0) {
+		if (fstatat64(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
 			if (errno != ENOENT)
-				oserror("Failed to re-stat object");
+				oserror("Failed to stat %s", name);
+			close(fd);
+			break;
+		}
 
-			close(dirfd);
-			goto object_already_gone;
+		/* it may have been replaced since the walker saw it */
+		if (unexpected_type(name, st.st_mode)) {
+			close(fd);
+			break;
 		}
 
-		if (fchdir(dirfd) < 0)
+		apply_access_time(&st);
+		child = create_object(dir, name, &st);
+
+		if (sp) {
+			close(fd);
+			put_object(dir);
+			dir = child;
+			continue;
+		}
+
+		child->mtime = st.st_mtime;
+		if (fchdir(fd) < 0)
 			oserror("Failed to change current directory");
-		if (object->atime >= st.st_atime)
-			cull_file(object->name);
 
-		close(dirfd);
+		busy = recently_busy(child);
+		if (!busy) {
+			busy = is_object_in_use(name);
+			note_busy(child, busy);
+		}
+
+		if (!busy) {
+			child->new = 0;
+			insert_into_cull_table(child);
+		}
+
+		put_object(child);
+		close(fd);
+		break;
 	}
 
-object_already_gone:
-	put_object(object);
+	put_object(dir);
 }
 
 /*****************************************************************************/
 /*
- * consider starting a cull
+ * let go of the units of work once the walkers are done with them
  */
-static void cull_objects(void)
+static void free_walk_units(void)
 {
-	if (ncullable <= 0)
-		error("Cullable object count is inconsistent");
+	unsigned loop;
+
+	for (loop = 0; loop < nwalk_units; loop++)
+		free(walk_units[loop].path);
+	free(walk_units);
+	walk_units = NULL;
+	nwalk_units = maxwalk_units = 0;
+
+	for (loop = 0; loop < nwalk_volumes; loop++)
+		free(walk_volumes[loop]);
+	free(walk_volumes);
+	walk_volumes = NULL;
+	nwalk_volumes = 0;
+}
+
+/*****************************************************************************/
+/*
+ * sweep the whole cache in parallel on startup, destroying unexpected objects
+ * and reaping the graves as we go, then fill the cull table with the oldest
+ * objects the walkers found
+ * - this stands in for the initial scan, so the cache is ready when it's done
+ * - nothing else is attended to until then
+ */
+static void sweep_cache(unsigned jobs)
+{
+	struct sweep_candidate **list;
+	struct sweep total;
+	struct dirent *de;
+	unsigned long long start = now_msec();
+	unsigned loop, i, n;
+	char path[PATH_MAX];
+	DIR *dir;
+	int rootfd, fd;
+
+	notice("Sweeping cache with %u walkers", jobs);
+
+	rootfd = open(cacheroot, O_RDONLY | O_DIRECTORY);
+	if (rootfd < 0)
+		oserror("Unable to open cache root %s", cacheroot);
+
+	/* the graves are units of their own, and go first as some of them
+	 * may be big */
+	fd = dup(graveyardfd);
+	if (fd < 0)
+		oserror("Unable to dup graveyard fd");
+	dir = fdopendir(fd);
+	if (!dir)
+		oserror("Unable to open graveyard");
 
-	if (cullready[oldest_ready]->cullable) {
-		cull_object(cullready[oldest_ready]);
-		cullready[oldest_ready] = (void *)(0x6b000000 | __LINE__);
-		oldest_ready--;
+	while (errno = 0, (de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		snprintf(path, sizeof(path), "graveyard/%s", de->d_name);
+		add_walk_unit(path, -1, 0);
+		walk_units[nwalk_units - 1].grave = 1;
 	}
 
-	/* must start refilling the cull table */
-	if (!scan && oldest_build <= culltable_size / 2 + 2) {
-		decant_cull_table();
+	if (errno != 0)
+		oserror("Unable to read graveyard");
+	closedir(dir);
 
-		debug(1, "Refilling cull table");
-		root.usage++;
-		scan = &root;
+	split_walk_units(rootfd, jobs);
+
+	/* the walkers between them keep no more candidates than the cull table
+	 * holds, and no more than their shares of the object budget if there
+	 * is one */
+	sweep_max = culltable_size / jobs;
+	if (objmem_limit) {
+		unsigned long long share = objmem_limit / jobs /
+			(sizeof(struct sweep_candidate) + SWEEP_NAME_BUDGET);
+
+		if (share < sweep_max)
+			sweep_max = share;
 	}
+	if (sweep_max < SWEEP_MIN_CANDIDATES)
+		sweep_max = SWEEP_MIN_CANDIDATES;
+	sweep_names_max = (size_t)sweep_max * SWEEP_NAME_BUDGET;
+
+	sweeps = map_shared(jobs * sizeof(sweeps[0]));
+	if (!nocull) {
+		for (loop = 0; loop < jobs; loop++) {
+			sweeps[loop].candidates =
+				map_shared(sweep_max *
+					   sizeof(struct sweep_candidate));
+			sweeps[loop].names = map_shared(sweep_names_max);
+		}
+	}
+
+	/* the walkers have nothing else to give time to */
+	slice_end = ~0ULL;
+	run_walkers(rootfd, jobs, sweep_unit);
+	close(rootfd);
+
+	memset(&total, 0, sizeof(total));
+	for (loop = 0; loop < jobs; loop++) {
+		total.dirs += sweeps[loop].dirs;
+		total.files += sweeps[loop].files;
+		total.unexpected += sweeps[loop].unexpected;
+		total.graves += sweeps[loop].graves;
+		total.dropped += sweeps[loop].dropped;
+		total.ncandidates += sweeps[loop].ncandidates;
+	}
+
+	nscanned += total.dirs + total.files + total.unexpected;
+	notice("Swept cache in %llums: %llu dirs, %llu files,"
+	       " %llu unexpected objects removed, %llu graves reaped",
+	       now_msec() - start, total.dirs, total.files,
+	       total.unexpected, total.graves);
+	if (total.dropped)
+		debug(1, "Sweep had no room for %llu candidates", total.dropped);
+
+	if (!nocull) {
+		/* take the oldest of what the walkers found and put them in
+		 * the cull table newest first so that each goes on the end */
+		list = malloc((total.ncandidates + 1) * sizeof(list[0]));
+		if (!list)
+			oserror("Unable to alloc sweep candidates");
+
+		n = 0;
+		for (loop = 0; loop < jobs; loop++)
+			for (i = 0; i < sweeps[loop].ncandidates; i++)
+				list[n++] = &sweeps[loop].candidates[i];
+
+		qsort(list, n, sizeof(list[0]), sweep_candidate_cmp);
+		if (n > culltable_size)
+			n = culltable_size;
+
+		for (i = n; i > 0; i--)
+			sweep_insert(sweeps[list[i - 1]->walker].names +
+				     list[i - 1]->path);
+		free(list);
+		debug(1, "Sweep found %u candidates", n);
+
+		for (loop = 0; loop < jobs; loop++) {
+			munmap(sweeps[loop].candidates, sweep_max *
+			       sizeof(struct sweep_candidate));
+			munmap(sweeps[loop].names, sweep_names_max);
+		}
+	}
+
+	munmap(sweeps, jobs * sizeof(sweeps[0]));
+	sweeps = NULL;
+	free_walk_units();
+
+	if (nocull)
+		return;
+
+	/* the sweep has seen everything the initial scan would have */
+	put_object(scan);
+	scan = NULL;
+	decant_cull_table();
+
+	time_to_ready = now_msec() - start_time;
+	notice("Cache ready (%llums after start)", time_to_ready);
 }
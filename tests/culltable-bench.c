@@ -0,0 +1,244 @@
+/* CacheFiles userspace management daemon cull table benchmark
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * Time the cull table operations the daemon leans on, on tables of the given
+ * log2 size:
+ *
+ *	culltable-bench [-c] [-n <log2size>] [-r <runs>]
+ *
+ * Each operation is timed a few thousand times against tables that have been
+ * set up already populated, so that the big tables can be measured without
+ * waiting for them to be filled one random insertion at a time.
+ *
+ * With -c, the CPU caches are flushed before each operation, as they will be
+ * when the daemon gets round to the table after a spell of scanning or
+ * sleeping, and fewer operations are timed.
+ *
+ * Run by "make bench".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "cachefilesd-culltable.h"
+
+#define NOPS		4096		/* operations timed per phase */
+#define NOPS_COLD	256		/* ditto with caches flushed */
+#define EVICT_SIZE	(64 * 1024 * 1024)	/* bigger than the LLC */
+#define ATIME_BASE	1700000000000000000LL
+#define ATIME_SPREAD	(86400 * 1000000000LL)	/* a day */
+
+struct object {
+	int		id;
+};
+
+static struct object *objects;
+static unsigned size, nops;
+static unsigned char *evict_buf;	/* NULL unless running cold */
+
+static unsigned long long now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void drop(struct cull_table *t, struct object *object)
+{
+}
+
+/*
+ * push the tables out of the CPU caches by dirtying something bigger
+ */
+static void evict_caches(void)
+{
+	size_t loop;
+
+	if (!evict_buf)
+		return;
+
+	for (loop = 0; loop < EVICT_SIZE; loop += 64)
+		evict_buf[loop]++;
+}
+
+static struct cull_key random_key(unsigned ino)
+{
+	struct cull_key key;
+
+	key.atime = ATIME_BASE +
+		((long long)random() << 16 ^ random()) % ATIME_SPREAD;
+	key.ino = ino;
+	return key;
+}
+
+/*
+ * fill the first n slots of a table with evenly spread keys, newest first
+ */
+static void populate(struct cull_table *t, unsigned n, unsigned first_object)
+{
+	unsigned loop;
+
+	for (loop = 0; loop < n; loop++) {
+		t->entries[loop].key.atime = ATIME_BASE + ATIME_SPREAD -
+			(ATIME_SPREAD / n) * (loop + 1);
+		t->entries[loop].key.ino = first_object + loop;
+		t->entries[loop].object = &objects[first_object + loop];
+	}
+	t->oldest = (int)n - 1;
+}
+
+static void report(const char *what, unsigned long long nsec, unsigned ops)
+{
+	printf("  %-24s %10u ops %10.1f ns/op\n",
+	       what, ops, ops ? (double)nsec / ops : 0.0);
+}
+
+/*
+ * time each of the operations once
+ */
+static void run(void)
+{
+	struct cull_table build = CULL_TABLE_INIT, ready = CULL_TABLE_INIT;
+	struct object *displaced;
+	unsigned long long start, nsec;
+	unsigned loop, n;
+
+	if (cull_table_resize(&build, size, drop) < 0 ||
+	    cull_table_resize(&ready, size, drop) < 0) {
+		perror("cull_table_resize");
+		exit(2);
+	}
+
+	/* a scan filling a half full table */
+	populate(&build, size / 2, 0);
+	nsec = 0;
+	for (loop = 0; loop < nops; loop++) {
+		struct cull_key key = random_key(size + loop);
+
+		evict_caches();
+		start = now_nsec();
+		cull_table_insert(&build, key, &objects[size + loop], 0,
+				  &displaced);
+		nsec += now_nsec() - start;
+		if (build.oldest >= (int)size - 1)
+			populate(&build, size / 2, 0);
+	}
+	report("insert", nsec, nops);
+
+	/* a scan carrying on past a full table, displacing the newest */
+	populate(&build, size, 0);
+	nsec = 0;
+	for (loop = 0; loop < nops; loop++) {
+		struct cull_key key = random_key(size + loop);
+
+		evict_caches();
+		start = now_nsec();
+		cull_table_insert(&build, key, &objects[size + loop], 1,
+				  &displaced);
+		nsec += now_nsec() - start;
+	}
+	report("insert into full table", nsec, nops);
+
+	/* fanotify seeing objects in the table used */
+	populate(&build, size, 0);
+	n = nops / 16;
+	nsec = 0;
+	for (loop = 0; loop < n; loop++) {
+		struct object *object =
+			build.entries[random() % (build.oldest + 1)].object;
+
+		evict_caches();
+		start = now_nsec();
+		cull_table_remove(&build, object);
+		nsec += now_nsec() - start;
+	}
+	report("remove", nsec, n);
+
+	/* handing a full build table over to a half full ready table */
+	populate(&build, size, 0);
+	populate(&ready, size / 2, size);
+	evict_caches();
+	start = now_nsec();
+	n = cull_table_decant(&build, &ready);
+	report("decant", now_nsec() - start, n);
+
+	/* culling the lot */
+	evict_caches();
+	start = now_nsec();
+	for (loop = 0; cull_table_pop(&ready); loop++) {;}
+	report("pop", now_nsec() - start, loop);
+
+	cull_table_free(&build);
+	cull_table_free(&ready);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned loop, runs = 3, log2size = 12;
+	int opt, cold = 0;
+
+	while (opt = getopt(argc, argv, "cn:r:"),
+	       opt != -1
+	       ) {
+		switch (opt) {
+		case 'c':
+			cold = 1;
+			break;
+		case 'n':
+			log2size = atoi(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: culltable-bench [-c] [-n <log2size>] [-r <runs>]\n");
+			exit(2);
+		}
+	}
+
+	if (log2size < 4 || log2size > 24 || runs < 1) {
+		fprintf(stderr, "culltable-bench: bad size or run count\n");
+		exit(2);
+	}
+
+	size = 1U << log2size;
+	nops = cold ? NOPS_COLD : NOPS;
+	if (nops > size)
+		nops = size;
+
+	if (cold) {
+		evict_buf = calloc(1, EVICT_SIZE);
+		if (!evict_buf) {
+			perror("calloc");
+			exit(2);
+		}
+	}
+
+	objects = calloc(size * 2 + nops, sizeof(objects[0]));
+	if (!objects) {
+		perror("calloc");
+		exit(2);
+	}
+	for (loop = 0; loop < size * 2 + nops; loop++)
+		objects[loop].id = loop;
+
+	srandom(1);
+	for (loop = 0; loop < runs; loop++) {
+		printf("culltable %u, %s caches, run %u:\n",
+		       log2size, cold ? "cold" : "warm", loop + 1);
+		run();
+	}
+
+	return 0;
+}
@@ -0,0 +1,427 @@
+/* CacheFiles userspace management daemon cull table tests
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * Drive the cull table library through insertion, displacement, removal,
+ * decanting and resizing, checking the tables against what they should hold.
+ * Run by "make test".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "cachefilesd-culltable.h"
+
+/* the library only handles pointers to objects, so these are just numbered */
+struct object {
+	int		id;
+};
+
+#define NOBJECTS	4096
+
+static struct object objects[NOBJECTS];
+static int failures, ndropped;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n",	\
+				__FILE__, __LINE__, __func__, #cond);	\
+			failures++;					\
+		}							\
+	} while (0)
+
+static struct cull_key key(long long atime, unsigned long long ino)
+{
+	struct cull_key k = { .atime = atime, .ino = ino };
+
+	return k;
+}
+
+static void drop(struct cull_table *t, struct object *object)
+{
+	ndropped++;
+}
+
+/*
+ * check that a table is in order, newest first
+ */
+static int table_sorted(const struct cull_table *t)
+{
+	int loop;
+
+	for (loop = 1; loop <= t->oldest; loop++)
+		if (cull_key_cmp(&t->entries[loop - 1].key,
+				 &t->entries[loop].key) <= 0)
+			return 0;
+	return 1;
+}
+
+static void init_table(struct cull_table *t, unsigned size)
+{
+	struct cull_table empty = CULL_TABLE_INIT;
+
+	*t = empty;
+	if (cull_table_resize(t, size, drop) < 0) {
+		perror("cull_table_resize");
+		exit(2);
+	}
+}
+
+/*
+ * insert objects with distinct shuffled atimes into a table with room for
+ * them all and check they come out oldest first
+ */
+static void test_insert(void)
+{
+	struct cull_table t;
+	struct object *displaced, *o;
+	int order[256], loop, j, tmp, ret;
+
+	init_table(&t, 256);
+
+	for (loop = 0; loop < 256; loop++)
+		order[loop] = loop;
+	srandom(1);
+	for (loop = 255; loop > 0; loop--) {
+		j = random() % (loop + 1);
+		tmp = order[loop];
+		order[loop] = order[j];
+		order[j] = tmp;
+	}
+
+	for (loop = 0; loop < 256; loop++) {
+		j = order[loop];
+		ret = cull_table_insert(&t, key(1000 + j * 10, j),
+					&objects[j], 0, &displaced);
+		CHECK(ret == 1);
+		CHECK(displaced == NULL);
+	}
+
+	CHECK(t.oldest == 255);
+	CHECK(table_sorted(&t));
+
+	for (loop = 0; loop < 256; loop++) {
+		o = cull_table_pop(&t);
+		CHECK(o == &objects[loop]);
+	}
+	CHECK(cull_table_pop(&t) == NULL);
+	CHECK(t.oldest == -1);
+
+	cull_table_free(&t);
+}
+
+/*
+ * objects accessed at the same time are ranked by inode number
+ */
+static void test_ties(void)
+{
+	struct cull_table t;
+	struct object *displaced;
+
+	init_table(&t, 8);
+
+	CHECK(cull_table_insert(&t, key(500, 30), &objects[30], 0,
+				&displaced) == 1);
+	CHECK(cull_table_insert(&t, key(500, 10), &objects[10], 0,
+				&displaced) == 1);
+	CHECK(cull_table_insert(&t, key(500, 20), &objects[20], 0,
+				&displaced) == 1);
+	CHECK(cull_table_insert(&t, key(499, 99), &objects[99], 0,
+				&displaced) == 1);
+
+	CHECK(table_sorted(&t));
+	CHECK(cull_table_pop(&t) == &objects[99]);
+	CHECK(cull_table_pop(&t) == &objects[10]);
+	CHECK(cull_table_pop(&t) == &objects[20]);
+	CHECK(cull_table_pop(&t) == &objects[30]);
+
+	cull_table_free(&t);
+}
+
+/*
+ * once a table is full, an older object displaces the newest and a younger
+ * one is turned away
+ */
+static void test_displace(void)
+{
+	struct cull_table t;
+	struct object *displaced;
+	int loop;
+
+	init_table(&t, 16);
+
+	/* atimes 100, 110, ... 250 */
+	for (loop = 0; loop < 16; loop++)
+		CHECK(cull_table_insert(&t, key(100 + loop * 10, loop),
+					&objects[loop], 0, &displaced) == 1);
+	CHECK(t.oldest == 15);
+
+	/* too young */
+	CHECK(cull_table_insert(&t, key(300, 100), &objects[100], 1,
+				&displaced) == 0);
+	CHECK(displaced == NULL);
+	CHECK(t.entries[0].object == &objects[15]);
+
+	/* as young as the newest isn't old enough either */
+	CHECK(cull_table_insert(&t, key(250, 15), &objects[101], 1,
+				&displaced) == 0);
+
+	/* older than the oldest: everything shifts */
+	CHECK(cull_table_insert(&t, key(50, 102), &objects[102], 1,
+				&displaced) == 1);
+	CHECK(displaced == &objects[15]);
+	CHECK(t.entries[t.oldest].object == &objects[102]);
+	CHECK(t.oldest == 15);
+	CHECK(table_sorted(&t));
+
+	/* between the newest two: goes in the first slot */
+	CHECK(cull_table_insert(&t, key(235, 103), &objects[103], 1,
+				&displaced) == 1);
+	CHECK(displaced == &objects[14]);
+	CHECK(t.entries[0].object == &objects[103]);
+	CHECK(table_sorted(&t));
+
+	/* in the middle */
+	CHECK(cull_table_insert(&t, key(155, 104), &objects[104], 1,
+				&displaced) == 1);
+	CHECK(displaced == &objects[103]);
+	CHECK(t.oldest == 15);
+	CHECK(table_sorted(&t));
+
+	/* just younger than the second newest */
+	CHECK(cull_table_insert(&t, key(221, 105), &objects[105], 1,
+				&displaced) == 1);
+	CHECK(displaced == &objects[13]);
+	CHECK(t.entries[0].object == &objects[105]);
+	CHECK(table_sorted(&t));
+
+	/* a table that's somehow overfull is reported */
+	t.oldest = 16;
+	CHECK(cull_table_insert(&t, key(1, 106), &objects[106], 1,
+				&displaced) == -EOVERFLOW);
+	t.oldest = 15;
+
+	cull_table_free(&t);
+}
+
+/*
+ * removal takes out just the one object and keeps the rest in order
+ */
+static void test_remove(void)
+{
+	struct cull_table t;
+	struct object *displaced;
+	int loop;
+
+	init_table(&t, 16);
+	for (loop = 0; loop < 10; loop++)
+		cull_table_insert(&t, key(1000 - loop, loop), &objects[loop],
+				  0, &displaced);
+
+	CHECK(cull_table_remove(&t, &objects[4]) == 1);
+	CHECK(t.oldest == 8);
+	CHECK(table_sorted(&t));
+	for (loop = 0; loop <= t.oldest; loop++)
+		CHECK(t.entries[loop].object != &objects[4]);
+
+	CHECK(cull_table_remove(&t, &objects[4]) == 0);
+	CHECK(cull_table_remove(&t, &objects[200]) == 0);
+
+	/* oldest and newest */
+	CHECK(cull_table_remove(&t, &objects[9]) == 1);
+	CHECK(cull_table_remove(&t, &objects[0]) == 1);
+	CHECK(t.oldest == 6);
+	CHECK(t.entries[0].object == &objects[1]);
+	CHECK(t.entries[t.oldest].object == &objects[8]);
+
+	cull_table_free(&t);
+}
+
+/*
+ * decanting moves the build table's oldest entries to the young end of the
+ * ready table, as many as will fit
+ */
+static void test_decant(void)
+{
+	struct cull_table build, ready;
+	struct object *displaced;
+	int loop;
+
+	init_table(&build, 8);
+	init_table(&ready, 8);
+
+	/* into an empty ready table, the lot goes */
+	for (loop = 0; loop < 5; loop++)
+		cull_table_insert(&build, key(100 + loop, loop),
+				  &objects[loop], 0, &displaced);
+	CHECK(cull_table_decant(&build, &ready) == 5);
+	CHECK(build.oldest == -1);
+	CHECK(ready.oldest == 4);
+	CHECK(table_sorted(&ready));
+	CHECK(ready.entries[4].object == &objects[0]);
+
+	/* only three more will fit, and they must be the oldest three */
+	for (loop = 10; loop < 16; loop++)
+		cull_table_insert(&build, key(200 + loop, loop),
+				  &objects[loop], 0, &displaced);
+	CHECK(cull_table_decant(&build, &ready) == 3);
+	CHECK(ready.oldest == 7);
+	CHECK(build.oldest == 2);
+	CHECK(ready.entries[0].object == &objects[12]);
+	CHECK(ready.entries[1].object == &objects[11]);
+	CHECK(ready.entries[2].object == &objects[10]);
+	CHECK(ready.entries[3].object == &objects[4]);
+	CHECK(build.entries[0].object == &objects[15]);
+	CHECK(build.entries[2].object == &objects[13]);
+	CHECK(table_sorted(&build));
+
+	/* no room left */
+	CHECK(cull_table_decant(&build, &ready) == 0);
+	CHECK(build.oldest == 2);
+
+	/* the ready table is culled from the oldest end */
+	CHECK(cull_table_pop(&ready) == &objects[0]);
+	CHECK(cull_table_decant(&build, &ready) == 1);
+	CHECK(ready.entries[0].object == &objects[13]);
+
+	/* a build table bigger than an empty ready table is refused */
+	ready.oldest = -1;
+	cull_table_free(&build);
+	init_table(&build, 16);
+	for (loop = 0; loop < 12; loop++)
+		cull_table_insert(&build, key(100 + loop, loop),
+				  &objects[loop], 0, &displaced);
+	CHECK(cull_table_decant(&build, &ready) == -EOVERFLOW);
+
+	cull_table_free(&build);
+	cull_table_free(&ready);
+}
+
+/*
+ * growing keeps everything; shrinking lets go of the newest
+ */
+static void test_resize(void)
+{
+	struct cull_table t;
+	struct object *displaced;
+	int loop;
+
+	init_table(&t, 8);
+	for (loop = 0; loop < 8; loop++)
+		cull_table_insert(&t, key(100 + loop, loop), &objects[loop],
+				  0, &displaced);
+
+	CHECK(cull_table_resize(&t, 32, drop) == 0);
+	CHECK(t.size == 32);
+	CHECK(t.oldest == 7);
+	CHECK(table_sorted(&t));
+
+	for (loop = 8; loop < 32; loop++)
+		CHECK(cull_table_insert(&t, key(100 + loop, loop),
+					&objects[loop], 0, &displaced) == 1);
+	CHECK(t.oldest == 31);
+
+	ndropped = 0;
+	CHECK(cull_table_resize(&t, 4, drop) == 0);
+	CHECK(ndropped == 28);
+	CHECK(t.size == 4);
+	CHECK(t.oldest == 3);
+	CHECK(t.entries[0].object == &objects[3]);
+	CHECK(t.entries[3].object == &objects[0]);
+
+	/* shrinking to no smaller than the contents drops nothing */
+	ndropped = 0;
+	CHECK(cull_table_resize(&t, 4, drop) == 0);
+	CHECK(ndropped == 0);
+
+	cull_table_free(&t);
+	CHECK(t.entries == NULL);
+	CHECK(t.oldest == -1);
+}
+
+/*
+ * throw random operations at a full table and check it always holds the
+ * oldest objects offered
+ */
+static void test_random(void)
+{
+	static char in_table[NOBJECTS];
+	struct cull_table t;
+	struct object *displaced;
+	long long atimes[NOBJECTS], newest;
+	int loop, n, ret, i;
+
+	init_table(&t, 64);
+	srandom(2);
+
+	for (loop = 0; loop < NOBJECTS; loop++) {
+		atimes[loop] = random() % 100000;
+		ret = cull_table_insert(&t, key(atimes[loop], loop),
+					&objects[loop], t.oldest >= 63,
+					&displaced);
+		CHECK(ret >= 0);
+		if (ret > 0)
+			in_table[loop] = 1;
+		if (displaced)
+			in_table[displaced - objects] = 0;
+		CHECK(table_sorted(&t));
+		CHECK(t.oldest <= 63);
+
+		/* take out a random object now and again */
+		if (loop % 7 == 0 && t.oldest >= 0) {
+			i = random() % (t.oldest + 1);
+			n = t.entries[i].object - objects;
+			CHECK(cull_table_remove(&t, &objects[n]) == 1);
+			in_table[n] = 0;
+		}
+	}
+
+	/* nothing outside the table that was still offered may be older than
+	 * the newest thing in it, unless it was removed */
+	newest = t.entries[0].key.atime;
+	n = 0;
+	for (loop = 0; loop < NOBJECTS; loop++)
+		if (in_table[loop])
+			n++;
+	CHECK(n == t.oldest + 1);
+	for (loop = 0; loop <= t.oldest; loop++) {
+		i = t.entries[loop].object - objects;
+		CHECK(in_table[i]);
+		CHECK(t.entries[loop].key.atime == atimes[i]);
+		CHECK(t.entries[loop].key.atime <= newest);
+	}
+
+	cull_table_free(&t);
+}
+
+int main(void)
+{
+	int loop;
+
+	for (loop = 0; loop < NOBJECTS; loop++)
+		objects[loop].id = loop;
+
+	test_insert();
+	test_ties();
+	test_displace();
+	test_remove();
+	test_decant();
+	test_resize();
+	test_random();
+
+	if (failures) {
+		fprintf(stderr, "culltable-test: %d checks failed\n", failures);
+		exit(1);
+	}
+
+	printf("culltable-test: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,357 @@
+/* CacheFiles userspace management daemon object tree tests
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * Drive the object tree library through creating, finding and putting
+ * objects, checking the reference counts, the accounting and the hooks, and
+ * read a scratch directory in both orders and reopen it by path.  Run by
+ * "make test".
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "cachefilesd-objtree.h"
+
+#define NFILES		300
+
+static int failures, ndiscovered, nreleased;
+static char scratch[] = "/tmp/objtree-test.XXXXXX";
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n",	\
+				__FILE__, __LINE__, __func__, #cond);	\
+			failures++;					\
+		}							\
+	} while (0)
+
+static void discover(struct object_tree *tree, struct object *object)
+{
+	ndiscovered++;
+}
+
+static void release(struct object_tree *tree, struct object *object)
+{
+	nreleased++;
+}
+
+static struct stat64 fake_stat(ino_t ino, long long atime)
+{
+	struct stat64 st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_atim.tv_sec = atime / NSEC_PER_SEC;
+	st.st_atim.tv_nsec = atime % NSEC_PER_SEC;
+	st.st_blocks = 8;
+	return st;
+}
+
+static struct object *create(struct object_tree *tree, struct object *parent,
+			     const char *name, ino_t ino)
+{
+	struct stat64 st = fake_stat(ino, ino * 1000LL);
+	struct object *object;
+
+	object = object_create(tree, parent, name, &st);
+	if (!object) {
+		perror("object_create");
+		exit(2);
+	}
+	return object;
+}
+
+/*
+ * check that a directory's children are in descending inode order and point
+ * back at it
+ */
+static int children_ordered(struct object *parent)
+{
+	struct object *p;
+
+	for (p = parent->children; p; p = p->next) {
+		if (p->parent != parent)
+			return 0;
+		if (p->next && (p->next->ino >= p->ino || p->next->prev != p))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * build a small tree and tear it down again
+ */
+static void test_create_put(void)
+{
+	struct object_tree tree = OBJECT_TREE_INIT(discover, release);
+	struct object *index, *fan, *data[8], *again, *prev, *p;
+	struct stat64 st;
+	ino_t inos[8] = { 50, 20, 80, 10, 70, 30, 60, 40 };
+	char name[16];
+	int loop;
+
+	ndiscovered = nreleased = 0;
+
+	index = create(&tree, &tree.root, "Inet", 2);
+	fan = create(&tree, index, "@4a", 3);
+	CHECK(index->type == OBJTYPE_INDEX);
+	CHECK(fan->type == OBJTYPE_INTERMEDIATE);
+	CHECK(tree.root.usage == 3);
+	CHECK(index->usage == 2);
+
+	for (loop = 0; loop < 8; loop++) {
+		sprintf(name, "%c%d", loop & 1 ? 'E' : 'D', loop);
+		data[loop] = create(&tree, fan, name, inos[loop]);
+		CHECK(data[loop]->type == OBJTYPE_DATA);
+		CHECK(data[loop]->usage == 1);
+		CHECK(data[loop]->new);
+		CHECK(data[loop]->atime == inos[loop] * 1000LL);
+		CHECK(data[loop]->blocks == 8);
+		CHECK(strcmp(data[loop]->name, name) == 0);
+	}
+
+	CHECK(create(&tree, fan, "Sspecial", 5)->type == OBJTYPE_SPECIAL);
+	CHECK(fan->usage == 10);
+	CHECK(tree.nobjects == 12);
+	CHECK(ndiscovered == 11);
+	CHECK(tree.objmem > 11 * sizeof(struct object));
+	CHECK(children_ordered(fan));
+
+	/* finding the children */
+	p = object_find(fan, 70, &prev);
+	CHECK(p == data[4]);
+	CHECK(prev == data[2]);
+	p = object_find(fan, 65, &prev);
+	CHECK(p == data[6]);
+	CHECK(prev == data[4]);
+	p = object_find(fan, 1, &prev);
+	CHECK(p == NULL);
+	CHECK(prev && prev->ino == 5);
+
+	/* creating something already there takes another reference */
+	st = fake_stat(70, 0);
+	again = object_create(&tree, fan, "E4", &st);
+	CHECK(again == data[4]);
+	CHECK(again->usage == 2);
+	CHECK(tree.nobjects == 12);
+	CHECK(ndiscovered == 11);
+
+	/* names CacheFiles doesn't make are refused */
+	st = fake_stat(99, 0);
+	errno = 0;
+	CHECK(object_create(&tree, fan, "xyzzy", &st) == NULL);
+	CHECK(errno == EINVAL);
+	CHECK(tree.nobjects == 12);
+
+	/* a directory can't go whilst it has children */
+	CHECK(object_put(&tree, index) == 0);
+	CHECK(object_put(&tree, index) == -EINVAL);
+	CHECK(index->usage == 1);
+	CHECK(tree.nobjects == 12);
+
+	/* putting the data objects frees them, and the last one takes the
+	 * directories above with it */
+	CHECK(object_put(&tree, data[4]) == 0);
+	CHECK(data[4]->usage == 1);
+	CHECK(object_put(&tree, fan) == 0);
+	for (loop = 0; loop < 8; loop++)
+		CHECK(object_put(&tree, data[loop]) == 0);
+	CHECK(nreleased == 8);
+	CHECK(tree.nobjects == 4);
+	CHECK(children_ordered(fan));
+
+	p = object_find(fan, 5, &prev);
+	CHECK(object_put(&tree, p) == 0);
+	CHECK(nreleased == 11);
+	CHECK(tree.nobjects == 1);
+	CHECK(tree.objmem == 0);
+	CHECK(tree.root.children == NULL);
+	CHECK(tree.root.usage == 2);
+
+	/* and the root is never freed */
+	CHECK(object_put(&tree, &tree.root) == 0);
+	CHECK(object_put(&tree, &tree.root) == -EINVAL);
+	CHECK(tree.root.usage == 1);
+}
+
+static int nexpired, expire_every;
+
+static int expired(void)
+{
+	return expire_every && ++nexpired % expire_every == 0;
+}
+
+/*
+ * read the scratch directory's entries in either order, taking several goes
+ * at it
+ */
+static void test_dirlist(int sorted)
+{
+	struct object dir;
+	struct dirent *de;
+	unsigned loop, seen[NFILES], n, goes;
+	ino_t order[NFILES + 2];
+	DIR *check;
+	char *name;
+	int ret;
+
+	memset(&dir, 0, sizeof(dir));
+	dir.dir = opendir(scratch);
+	if (!dir.dir) {
+		perror(scratch);
+		exit(2);
+	}
+
+	nexpired = 0;
+	expire_every = 50;
+	goes = 0;
+	do {
+		ret = dirlist_fill(&dir, sorted, expired);
+		goes++;
+	} while (ret == 0);
+	CHECK(ret == 1);
+	CHECK(goes > 1);
+	CHECK(dir.list->complete);
+	CHECK(dir.list->nentries == NFILES + 1);
+	CHECK(dir.list->pos == 0);
+
+	memset(seen, 0, sizeof(seen));
+	for (loop = 0; loop < dir.list->nentries; loop++) {
+		name = dir.list->names + dir.list->entries[loop].name;
+		CHECK(strcmp(name, ".") != 0 && strcmp(name, "..") != 0);
+		if (sscanf(name, "D%u", &n) == 1 && n < NFILES)
+			seen[n]++;
+		else
+			CHECK(strcmp(name, "Isub") == 0);
+	}
+	for (loop = 0; loop < NFILES; loop++)
+		CHECK(seen[loop] == 1);
+
+	if (sorted) {
+		for (loop = 1; loop < dir.list->nentries; loop++)
+			CHECK(dir.list->entries[loop - 1].ino <
+			      dir.list->entries[loop].ino);
+	}
+	else {
+		/* unsorted means the order readdir gave them in */
+		check = opendir(scratch);
+		n = 0;
+		while ((de = readdir(check)))
+			if (strcmp(de->d_name, ".") != 0 &&
+			    strcmp(de->d_name, "..") != 0)
+				order[n++] = de->d_ino;
+		closedir(check);
+		CHECK(n == dir.list->nentries);
+		for (loop = 0; loop < n; loop++)
+			CHECK(dir.list->entries[loop].ino == order[loop]);
+	}
+
+	dirlist_free(&dir);
+	CHECK(dir.list == NULL);
+	closedir(dir.dir);
+}
+
+/*
+ * reopen directories by path from the nearest open ancestor
+ */
+static void test_dir_fd(void)
+{
+	struct object_tree tree = OBJECT_TREE_INIT(NULL, NULL);
+	struct object *sub, *fan;
+	struct stat64 st, st2;
+	char path[sizeof(scratch) + 32];
+	int fd;
+
+	tree.root.dir = opendir(scratch);
+
+	snprintf(path, sizeof(path), "%s/Isub", scratch);
+	stat64(path, &st);
+	sub = object_create(&tree, &tree.root, "Isub", &st);
+	snprintf(path, sizeof(path), "%s/Isub/@4f", scratch);
+	stat64(path, &st);
+	fan = object_create(&tree, sub, "@4f", &st);
+
+	fd = object_dir_fd(fan);
+	CHECK(fd >= 0);
+	if (fd >= 0) {
+		fstat64(fd, &st2);
+		CHECK(st2.st_ino == fan->ino);
+		close(fd);
+	}
+
+	fd = object_dir_fd(&tree.root);
+	CHECK(fd >= 0);
+	if (fd >= 0)
+		close(fd);
+
+	/* a directory that's gone, or whose parent has gone, is -ENOENT */
+	rmdir(path);
+	CHECK(object_dir_fd(fan) == -ENOENT);
+	snprintf(path, sizeof(path), "%s/Isub", scratch);
+	rmdir(path);
+	CHECK(object_dir_fd(sub) == -ENOENT);
+	CHECK(object_dir_fd(fan) == -ENOENT);
+
+	CHECK(object_put(&tree, fan) == 0);
+	CHECK(tree.nobjects == 2);
+	CHECK(object_put(&tree, sub) == 0);
+	CHECK(tree.nobjects == 1);
+	closedir(tree.root.dir);
+}
+
+int main(void)
+{
+	char path[sizeof(scratch) + 32];
+	unsigned loop;
+	int fd;
+
+	if (!mkdtemp(scratch)) {
+		perror("mkdtemp");
+		exit(2);
+	}
+
+	for (loop = 0; loop < NFILES; loop++) {
+		snprintf(path, sizeof(path), "%s/D%u", scratch, loop);
+		fd = open(path, O_CREAT | O_WRONLY, 0600);
+		if (fd < 0) {
+			perror(path);
+			exit(2);
+		}
+		close(fd);
+	}
+	snprintf(path, sizeof(path), "%s/Isub", scratch);
+	mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/Isub/@4f", scratch);
+	mkdir(path, 0700);
+
+	test_create_put();
+	test_dirlist(1);
+	test_dirlist(0);
+	test_dir_fd();
+
+	for (loop = 0; loop < NFILES; loop++) {
+		snprintf(path, sizeof(path), "%s/D%u", scratch, loop);
+		unlink(path);
+	}
+	rmdir(scratch);
+
+	if (failures) {
+		fprintf(stderr, "objtree-test: %d checks failed\n", failures);
+		exit(1);
+	}
+
+	printf("objtree-test: all checks passed\n");
+	return 0;
+}
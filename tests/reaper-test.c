@@ -0,0 +1,358 @@
+/* CacheFiles userspace management daemon graveyard reaper tests
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * Fill a scratch graveyard with files and directory trees and have the reaper
+ * library empty it, checking that it yields when told to and carries on where
+ * it left off, truncates big files in steps, keeps its latency histogram and
+ * reaps the heaviest graves first when the cache is short of something.  Run
+ * by "make test".
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "cachefilesd-reaper.h"
+
+#define KB		1024ULL
+
+static int failures;
+static char scratch[] = "/tmp/reaper-test.XXXXXX";
+static char graveyard[sizeof(scratch) + 16];
+
+static unsigned nfiles, ndirs, nexpired, expire_every;
+static unsigned long long nblocks;
+static char first[NAME_MAX + 1];
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n",	\
+				__FILE__, __LINE__, __func__, #cond);	\
+			failures++;					\
+		}							\
+	} while (0)
+
+static int expired(void)
+{
+	return expire_every && ++nexpired % expire_every == 0;
+}
+
+static void reaped(struct reaper *r, const char *name,
+		   unsigned long long blocks, int isdir)
+{
+	if (!first[0])
+		strcpy(first, name);
+	if (isdir)
+		ndirs++;
+	else
+		nfiles++;
+	nblocks += blocks;
+}
+
+static void reset_counts(void)
+{
+	nfiles = ndirs = nexpired = 0;
+	nblocks = 0;
+	first[0] = 0;
+}
+
+static void make_file(const char *dir, const char *name,
+		      unsigned long long size)
+{
+	char path[PATH_MAX], buf[4096];
+	unsigned long long done;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	if (fd < 0) {
+		perror(path);
+		exit(2);
+	}
+
+	/* the space must really be allocated for truncation to be wanted */
+	memset(buf, 'x', sizeof(buf));
+	for (done = 0; done < size; done += sizeof(buf))
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			perror(path);
+			exit(2);
+		}
+	close(fd);
+}
+
+static void make_dir(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (mkdir(path, 0700) < 0) {
+		perror(path);
+		exit(2);
+	}
+}
+
+/*
+ * make a grave that's a directory tree of small files
+ */
+static void make_tree(const char *name, unsigned width, unsigned depth)
+{
+	char path[256], fname[16];
+	unsigned loop;
+
+	make_dir(graveyard, name);
+	snprintf(path, sizeof(path), "%s/%s", graveyard, name);
+
+	for (; depth > 0; depth--) {
+		for (loop = 0; loop < width; loop++) {
+			snprintf(fname, sizeof(fname), "f%u", loop);
+			make_file(path, fname, 0);
+		}
+		make_dir(path, "sub");
+		strcat(path, "/sub");
+	}
+}
+
+static int graveyard_empty(void)
+{
+	struct dirent *de;
+	DIR *dir;
+	int n = 0;
+
+	dir = opendir(graveyard);
+	while ((de = readdir(dir)))
+		if (strcmp(de->d_name, ".") != 0 &&
+		    strcmp(de->d_name, "..") != 0)
+			n++;
+	closedir(dir);
+	return n == 0;
+}
+
+static unsigned long long hist_total(const struct reaper *r)
+{
+	unsigned long long total = 0;
+	int loop;
+
+	for (loop = 0; loop < REAP_HIST_SIZE; loop++)
+		total += r->latency_hist[loop];
+	return total;
+}
+
+static void init_reaper(struct reaper *r)
+{
+	struct reaper init = REAPER_INIT(expired, reaped);
+
+	*r = init;
+	r->graveyardfd = open(graveyard, O_DIRECTORY);
+	if (r->graveyardfd < 0) {
+		perror(graveyard);
+		exit(2);
+	}
+}
+
+/*
+ * empty a graveyard of assorted graves a few entries at a time
+ */
+static void test_reap(void)
+{
+	struct reaper r;
+	char path[PATH_MAX];
+	unsigned goes;
+	int ret;
+
+	make_tree("Dtree", 20, 4);
+	make_file(graveyard, "Dlone", 4 * KB);
+	make_dir(graveyard, "Dempty");
+	make_dir(graveyard, "..odd");
+	make_file(graveyard, "..odd/f", 0);
+	snprintf(path, sizeof(path), "%s/Dlink", graveyard);
+	if (symlink("/", path) < 0) {
+		perror(path);
+		exit(2);
+	}
+
+	init_reaper(&r);
+	r.trunc_threshold = 0;
+	reset_counts();
+	expire_every = 7;
+
+	goes = 0;
+	do {
+		ret = reaper_reap(&r, NO_PRESSURE);
+		goes++;
+	} while (ret == 0 && goes < 10000);
+
+	CHECK(ret == 1);
+	CHECK(goes > 10);
+	CHECK(graveyard_empty());
+	CHECK(nfiles == 20 * 4 + 1 + 1 + 1);
+	CHECK(ndirs == 1 + 4 + 1 + 1);
+	CHECK(nblocks >= 8);
+	CHECK(hist_total(&r) == nfiles + ndirs);
+
+	/* there's nothing more to do */
+	CHECK(reaper_reap(&r, NO_PRESSURE) == 1);
+
+	reaper_free(&r);
+	close(r.graveyardfd);
+}
+
+/*
+ * a big file is truncated a step at a time, yielding between steps
+ */
+static void test_truncate(void)
+{
+	struct reaper r;
+	struct stat st;
+	char path[PATH_MAX];
+	unsigned goes;
+	int ret;
+
+	make_file(graveyard, "Dbig", 256 * KB);
+	snprintf(path, sizeof(path), "%s/Dbig", graveyard);
+
+	init_reaper(&r);
+	r.trunc_threshold = 64 * KB;
+	r.trunc_step = 32 * KB;
+	reset_counts();
+	expire_every = 2;
+
+	/* the first go gives back one step and then yields */
+	CHECK(reaper_reap(&r, NO_PRESSURE) == 0);
+	CHECK(stat(path, &st) == 0);
+	CHECK(st.st_size == 224 * KB);
+	CHECK(nfiles == 0);
+
+	goes = 1;
+	do {
+		ret = reaper_reap(&r, NO_PRESSURE);
+		goes++;
+	} while (ret == 0 && goes < 1000);
+
+	/* each go gives back a step until it's down to the threshold, when
+	 * it's unlinked */
+	CHECK(ret == 1);
+	CHECK(goes >= 6);
+	CHECK(graveyard_empty());
+	CHECK(nfiles == 1);
+	CHECK(hist_total(&r) == goes);
+
+	/* below the threshold, files are just unlinked */
+	make_file(graveyard, "Dsmall", 32 * KB);
+	reset_counts();
+	expire_every = 0;
+	memset(r.latency_hist, 0, sizeof(r.latency_hist));
+	CHECK(reaper_reap(&r, NO_PRESSURE) == 1);
+	CHECK(nfiles == 1);
+	CHECK(hist_total(&r) == 1);
+
+	reaper_free(&r);
+	close(r.graveyardfd);
+}
+
+/*
+ * under pressure, the graves that give back most of what's short go first
+ */
+static void test_pressure(void)
+{
+	struct reaper r;
+
+	make_file(graveyard, "Dheavy", 256 * KB);
+	make_tree("Dmany", 50, 1);
+	make_file(graveyard, "Dlight", 0);
+
+	init_reaper(&r);
+	r.trunc_threshold = 0;
+	r.reaped = reaped;
+	expire_every = 0;
+
+	reset_counts();
+	CHECK(reaper_reap(&r, BLOCK_PRESSURE) == 1);
+	CHECK(strcmp(first, "Dheavy") == 0);
+	CHECK(r.ranked_by == BLOCK_PRESSURE);
+	CHECK(graveyard_empty());
+
+	make_file(graveyard, "Dheavy", 256 * KB);
+	make_tree("Dmany", 50, 1);
+	make_file(graveyard, "Dlight", 0);
+
+	/* the files in the tree are reaped before the tree itself */
+	reset_counts();
+	CHECK(reaper_reap(&r, FILE_PRESSURE) == 1);
+	CHECK(first[0] == 'f' || strcmp(first, "sub") == 0);
+	CHECK(r.ranked_by == FILE_PRESSURE);
+	CHECK(graveyard_empty());
+
+	reaper_free(&r);
+	close(r.graveyardfd);
+}
+
+/*
+ * graves can be reaped by path from elsewhere, as the startup sweep does
+ */
+static void test_grave_by_path(void)
+{
+	struct reaper r = REAPER_INIT(NULL, NULL);
+	int rootfd;
+
+	make_tree("Dswept", 5, 3);
+	make_file(graveyard, "Dfile", 0);
+
+	rootfd = open(scratch, O_DIRECTORY);
+	CHECK(reaper_reap_grave(&r, rootfd, "graveyard/Dswept") == 1);
+	CHECK(reaper_reap_grave(&r, rootfd, "graveyard/Dfile") == 1);
+	CHECK(reaper_reap_grave(&r, rootfd, "graveyard/Dnone") == 1);
+	CHECK(graveyard_empty());
+
+	/* errors are handed back */
+	CHECK(reaper_reap_grave(&r, -1, "Dfile") == -EBADF);
+	CHECK(reaper_reap(&r, NO_PRESSURE) == -EBADF);
+	close(rootfd);
+}
+
+int main(void)
+{
+	char cwd[PATH_MAX], now[PATH_MAX];
+
+	if (!mkdtemp(scratch)) {
+		perror("mkdtemp");
+		exit(2);
+	}
+	snprintf(graveyard, sizeof(graveyard), "%s/graveyard", scratch);
+	make_dir(scratch, "graveyard");
+
+	if (!getcwd(cwd, sizeof(cwd))) {
+		perror("getcwd");
+		exit(2);
+	}
+
+	test_reap();
+	test_truncate();
+	test_pressure();
+	test_grave_by_path();
+
+	/* the reaper doesn't move the current directory */
+	CHECK(getcwd(now, sizeof(now)) && strcmp(cwd, now) == 0);
+
+	rmdir(graveyard);
+	rmdir(scratch);
+
+	if (failures) {
+		fprintf(stderr, "reaper-test: %d checks failed\n", failures);
+		exit(1);
+	}
+
+	printf("reaper-test: all checks passed\n");
+	return 0;
+}
@@ -0,0 +1,336 @@
+/* CacheFiles userspace management daemon cold scan benchmark
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * Time an initial scan of a cache with the page, dentry and inode caches
+ * dropped before each run, as after a reboot:
+ *
+ *	scan-bench [-o inode|readdir|both] [-r <runs>] [-f <files>] <dir>
+ *
+ * A fake cache of the given number of data files, with scattered atimes, is
+ * made in <dir> the first time and reused after that; put it on the
+ * filesystem of interest.  Dropping the caches needs root; without it the
+ * scans are warm and that's said.
+ *
+ * The scan is done as the daemon does it, with the object tree and cull table
+ * libraries: each directory is read whole, its entries statted and turned
+ * into objects and the data objects ranked in a cull table.  -o picks whether
+ * the entries are statted in inode number order, as the daemon does, or in
+ * the order readdir returns them; by default each run times both, one after
+ * the other on the same cold tree.  XFS bulkstat isn't used.
+ *
+ * Run by "make bench".
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "cachefilesd-objtree.h"
+#include "cachefilesd-culltable.h"
+
+#define FAN_DIRS	64		/* intermediate dirs per volume */
+#define CULLTABLE_SIZE	4096		/* the daemon's default */
+
+enum order {
+	ORDER_INODE	= 1,
+	ORDER_READDIR	= 2,
+	ORDER_BOTH	= 3,
+};
+
+static struct object_tree tree = OBJECT_TREE_INIT(NULL, NULL);
+static struct cull_table table = CULL_TABLE_INIT;
+static unsigned long long nscanned, nstats;
+
+static __attribute__((noreturn, format(printf, 1, 2)))
+void oserror(const char *fmt, ...)
+{
+	va_list va;
+	int err = errno;
+
+	va_start(va, fmt);
+	fprintf(stderr, "scan-bench: ");
+	vfprintf(stderr, fmt, va);
+	fprintf(stderr, ": %s\n", strerror(err));
+	va_end(va);
+	exit(1);
+}
+
+static unsigned long long now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * make a fake cache laid out as CacheFiles would lay it out
+ * - the volume is built under a temporary name and renamed when complete, so
+ *   an interrupted build is started again next time
+ */
+static void make_cache(const char *dir, unsigned nfiles)
+{
+	struct timespec times[2];
+	char path[PATH_MAX], vol[PATH_MAX];
+	unsigned loop;
+	int fd;
+
+	snprintf(vol, sizeof(vol), "%s/cache/@4a/I03nfs", dir);
+	if (access(vol, F_OK) == 0)
+		return;
+
+	printf("Making a cache of %u files in %s\n", nfiles, dir);
+
+	snprintf(path, sizeof(path), "%s/graveyard", dir);
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		oserror("Unable to make %s", dir);
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		oserror("Unable to make %s", path);
+	snprintf(path, sizeof(path), "%s/cache", dir);
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		oserror("Unable to make %s", path);
+	snprintf(path, sizeof(path), "%s/cache/@4a", dir);
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		oserror("Unable to make %s", path);
+	snprintf(path, sizeof(path), "%s/cache/@4a/+building", dir);
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		oserror("Unable to make %s", path);
+
+	for (loop = 0; loop < FAN_DIRS; loop++) {
+		snprintf(path, sizeof(path), "%s/cache/@4a/+building/@%02x",
+			 dir, loop);
+		if (mkdir(path, 0700) < 0 && errno != EEXIST)
+			oserror("Unable to make %s", path);
+	}
+
+	srandom(1);
+	times[1].tv_sec = 0;
+	times[1].tv_nsec = UTIME_OMIT;
+	for (loop = 0; loop < nfiles; loop++) {
+		snprintf(path, sizeof(path),
+			 "%s/cache/@4a/+building/@%02x/D%08x",
+			 dir, (unsigned)random() % FAN_DIRS, loop);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || write(fd, "x", 1) != 1)
+			oserror("Unable to make %s", path);
+
+		times[0].tv_sec = 1700000000 + random() % 86400;
+		times[0].tv_nsec = random() % 1000000000;
+		if (futimens(fd, times) < 0)
+			oserror("Unable to set atime on %s", path);
+		close(fd);
+	}
+
+	snprintf(path, sizeof(path), "%s/cache/@4a/+building", dir);
+	if (rename(path, vol) < 0)
+		oserror("Unable to rename %s", path);
+}
+
+/*
+ * drop the clean page cache, dentries and inodes
+ * - returns 0 if we can't
+ */
+static int drop_caches(void)
+{
+	int fd, ok;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0)
+		return 0;
+	ok = write(fd, "3", 1) == 1;
+	close(fd);
+	return ok;
+}
+
+/*
+ * rank a data object in the cull table, displacing the newest if it's full
+ */
+static void rank_object(struct object *object)
+{
+	struct cull_key key = { .atime = object->atime, .ino = object->ino };
+	struct object *displaced;
+	int ret;
+
+	ret = cull_table_insert(&table, key, object,
+				table.oldest >= (int)table.size - 1,
+				&displaced);
+	if (ret < 0) {
+		errno = -ret;
+		oserror("Unable to insert %s", object->name);
+	}
+	if (displaced)
+		object_put(&tree, displaced);
+	if (ret > 0)
+		object->usage++;
+}
+
+/*
+ * scan a directory that's been opened, and all the directories below it
+ */
+static void scan_dir(struct object *dir, int sorted)
+{
+	struct dirlist_entry *ent;
+	struct object *child;
+	struct stat64 st;
+	const char *name;
+	int ret, fd;
+
+	ret = dirlist_fill(dir, sorted, NULL);
+	if (ret < 0) {
+		errno = -ret;
+		oserror("Unable to read %s", dir->name);
+	}
+
+	for (; dir->list->pos < dir->list->nentries; dir->list->pos++) {
+		ent = &dir->list->entries[dir->list->pos];
+		name = dir->list->names + ent->name;
+		nscanned++;
+
+		nstats++;
+		if (fstatat64(dirfd(dir->dir), name, &st,
+			      AT_SYMLINK_NOFOLLOW) < 0)
+			oserror("Unable to stat %s", name);
+
+		child = object_create(&tree, dir, name, &st);
+		if (!child)
+			oserror("Unable to make object for %s", name);
+
+		if (S_ISDIR(st.st_mode)) {
+			fd = openat(dirfd(dir->dir), name, O_DIRECTORY);
+			if (fd < 0)
+				oserror("Unable to open %s", name);
+			child->dir = fdopendir(fd);
+			if (!child->dir)
+				oserror("Unable to open %s", name);
+			tree.nopendir++;
+
+			scan_dir(child, sorted);
+
+			dirlist_free(child);
+			closedir(child->dir);
+			child->dir = NULL;
+			tree.nopendir--;
+		}
+		else if (child->type == OBJTYPE_DATA) {
+			rank_object(child);
+		}
+
+		object_put(&tree, child);
+	}
+}
+
+/*
+ * scan the cache once, as a freshly started daemon would
+ */
+static void scan_once(const char *dir, int run, int cold, int sorted)
+{
+	unsigned long long start;
+	char path[PATH_MAX];
+	struct object *object;
+	int kept;
+
+	nscanned = nstats = 0;
+	if (cull_table_resize(&table, CULLTABLE_SIZE, NULL) < 0)
+		oserror("Unable to allocate cull table");
+
+	start = now_usec();
+
+	snprintf(path, sizeof(path), "%s/cache", dir);
+	tree.root.dir = opendir(path);
+	if (!tree.root.dir)
+		oserror("Unable to open %s", path);
+	tree.nopendir++;
+
+	scan_dir(&tree.root, sorted);
+
+	printf("  run %d (%s, %s order): %8.1f ms,"
+	       " %llu scanned, %llu statted\n",
+	       run, cold ? "cold" : "warm", sorted ? "inode" : "readdir",
+	       (now_usec() - start) / 1000.0, nscanned, nstats);
+
+	/* throw it all away again ready for the next run */
+	kept = table.oldest + 1;
+	while ((object = cull_table_pop(&table)))
+		object_put(&tree, object);
+	dirlist_free(&tree.root);
+	closedir(tree.root.dir);
+	tree.root.dir = NULL;
+	tree.nopendir--;
+
+	if (tree.nobjects != 1 || kept == 0) {
+		fprintf(stderr, "scan-bench: %d objects left, %d ranked\n",
+			tree.nobjects, kept);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	enum order order = ORDER_BOTH;
+	unsigned nfiles = 100000;
+	int opt, runs = 3, loop, cold;
+
+	while (opt = getopt(argc, argv, "f:o:r:"),
+	       opt != -1
+	       ) {
+		switch (opt) {
+		case 'f':
+			nfiles = atoi(optarg);
+			break;
+		case 'o':
+			if (strcmp(optarg, "inode") == 0)
+				order = ORDER_INODE;
+			else if (strcmp(optarg, "readdir") == 0)
+				order = ORDER_READDIR;
+			else if (strcmp(optarg, "both") == 0)
+				order = ORDER_BOTH;
+			else
+				goto usage;
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (optind != argc - 1 || runs < 1 || nfiles < 1)
+		goto usage;
+
+	make_cache(argv[optind], nfiles);
+
+	printf("Cold scans of %s:\n", argv[optind]);
+	for (loop = 1; loop <= runs; loop++) {
+		if (order & ORDER_INODE) {
+			cold = drop_caches();
+			scan_once(argv[optind], loop, cold, 1);
+		}
+		if (order & ORDER_READDIR) {
+			cold = drop_caches();
+			scan_once(argv[optind], loop, cold, 0);
+		}
+	}
+
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: scan-bench [-o inode|readdir|both]"
+		" [-r <runs>] [-f <files>] <dir>\n");
+	exit(2);
+}
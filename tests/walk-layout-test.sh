@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# CacheFiles userspace management daemon walk layout test
+#
+# Copyright (C) 2026 The cachefilesd contributors.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version
+# 2 of the License, or (at your option) any later version.
+#
+#
+# Build a small cache in each of the layouts cachefiles has used, the older
+# one with the index volumes below a level of fan-out directories
+# (cache/@xx/Iname/@yy/Dfile) and the newer one with them directly in the
+# cache directory (cache/Iname/@yy/Dfile), analyse each with a range of
+# walkers and check that every volume is found once, with all of its files.
+# Run by "make test".
+#
+
+CACHEFILESD=${CACHEFILESD:-./cachefilesd}
+failures=0
+
+tmp=$(mktemp -d /tmp/cachefilesd-walk.XXXXXX) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# make_volume <volume dir>: two fan-out dirs of five data files each
+make_volume()
+{
+	for fan in @1a @2b; do
+		mkdir -p "$1/$fan"
+		for n in 1 2 3 4 5; do
+			echo x >"$1/$fan/Dfile$n"
+		done
+	done
+}
+
+mkdir -p "$tmp/old/cache/@41" "$tmp/old/cache/@42" "$tmp/old/graveyard"
+make_volume "$tmp/old/cache/@41/Inet1"
+make_volume "$tmp/old/cache/@41/Inet2"
+make_volume "$tmp/old/cache/@42/Inet3"
+
+mkdir -p "$tmp/new/cache" "$tmp/new/graveyard"
+make_volume "$tmp/new/cache/Inet1"
+make_volume "$tmp/new/cache/Inet2"
+make_volume "$tmp/new/cache/Inet3"
+
+# check <layout> <jobs> <volume names...>
+check()
+{
+	layout=$1
+	jobs=$2
+	shift 2
+
+	if ! "$CACHEFILESD" -a "$tmp/$layout" -j "$jobs" >"$tmp/out" 2>&1; then
+		echo "$layout layout, $jobs jobs: analysis failed"
+		cat "$tmp/out"
+		failures=$((failures + 1))
+		return
+	fi
+
+	found=$(grep -c '"name":' "$tmp/out")
+	if [ "$found" -ne $# ]; then
+		echo "$layout layout, $jobs jobs: found $found volumes, not $#"
+		failures=$((failures + 1))
+	fi
+
+	for vol; do
+		if ! grep -q "\"name\": \"$vol\", \"dirs\": [0-9]*, \"files\": 10," \
+		     "$tmp/out"; then
+			echo "$layout layout, $jobs jobs: volume $vol wrong"
+			failures=$((failures + 1))
+		fi
+	done
+}
+
+for jobs in 1 2 8; do
+	check old $jobs @41/Inet1 @41/Inet2 @42/Inet3
+	check new $jobs Inet1 Inet2 Inet3
+done
+
+if [ $failures -ne 0 ]; then
+	echo "walk-layout-test: $failures checks failed"
+	exit 1
+fi
+echo "walk-layout-test: all checks passed"
@@ -0,0 +1,98 @@
+/* CacheFiles userspace management daemon XFS layout test
+ *
+ * Copyright (C) 2026 The cachefilesd contributors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ *
+ * Check the bulkstat structures copied into cachefilesd-xfs.h against the
+ * ones in the system's <xfs/xfs_fs.h>.  The checks are all made at compile
+ * time; run by "make test" if xfsprogs' headers are installed.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <xfs/xfs.h>
+
+/* pull in our copies under other names alongside the system's */
+#undef XFS_IOC_BULKSTAT
+#define xfs_bulkstat		cfd_xfs_bulkstat
+#define xfs_bulk_ireq		cfd_xfs_bulk_ireq
+#define xfs_bulkstat_req	cfd_xfs_bulkstat_req
+#include "cachefilesd-xfs.h"
+#undef xfs_bulkstat
+#undef xfs_bulk_ireq
+#undef xfs_bulkstat_req
+
+#define CHECK_FIELD(s, f)						\
+	_Static_assert(offsetof(struct s, f) ==				\
+		       offsetof(struct cfd_##s, f),			\
+		       #s "." #f " is in the wrong place");		\
+	_Static_assert(sizeof(((struct s *)0)->f) ==			\
+		       sizeof(((struct cfd_##s *)0)->f),		\
+		       #s "." #f " is the wrong size")
+
+#define CHECK_SIZE(s)							\
+	_Static_assert(sizeof(struct s) == sizeof(struct cfd_##s),	\
+		       #s " is the wrong size")
+
+CHECK_SIZE(xfs_bulkstat);
+CHECK_FIELD(xfs_bulkstat, bs_ino);
+CHECK_FIELD(xfs_bulkstat, bs_size);
+CHECK_FIELD(xfs_bulkstat, bs_blocks);
+CHECK_FIELD(xfs_bulkstat, bs_xflags);
+CHECK_FIELD(xfs_bulkstat, bs_atime);
+CHECK_FIELD(xfs_bulkstat, bs_mtime);
+CHECK_FIELD(xfs_bulkstat, bs_ctime);
+CHECK_FIELD(xfs_bulkstat, bs_btime);
+CHECK_FIELD(xfs_bulkstat, bs_gen);
+CHECK_FIELD(xfs_bulkstat, bs_uid);
+CHECK_FIELD(xfs_bulkstat, bs_gid);
+CHECK_FIELD(xfs_bulkstat, bs_projectid);
+CHECK_FIELD(xfs_bulkstat, bs_atime_nsec);
+CHECK_FIELD(xfs_bulkstat, bs_mtime_nsec);
+CHECK_FIELD(xfs_bulkstat, bs_ctime_nsec);
+CHECK_FIELD(xfs_bulkstat, bs_btime_nsec);
+CHECK_FIELD(xfs_bulkstat, bs_blksize);
+CHECK_FIELD(xfs_bulkstat, bs_rdev);
+CHECK_FIELD(xfs_bulkstat, bs_cowextsize_blks);
+CHECK_FIELD(xfs_bulkstat, bs_extsize_blks);
+CHECK_FIELD(xfs_bulkstat, bs_nlink);
+CHECK_FIELD(xfs_bulkstat, bs_extents);
+CHECK_FIELD(xfs_bulkstat, bs_aextents);
+CHECK_FIELD(xfs_bulkstat, bs_version);
+CHECK_FIELD(xfs_bulkstat, bs_forkoff);
+CHECK_FIELD(xfs_bulkstat, bs_sick);
+CHECK_FIELD(xfs_bulkstat, bs_checked);
+CHECK_FIELD(xfs_bulkstat, bs_mode);
+CHECK_FIELD(xfs_bulkstat, bs_pad2);
+CHECK_FIELD(xfs_bulkstat, bs_extents64);
+CHECK_FIELD(xfs_bulkstat, bs_pad);
+
+CHECK_SIZE(xfs_bulk_ireq);
+CHECK_FIELD(xfs_bulk_ireq, ino);
+CHECK_FIELD(xfs_bulk_ireq, flags);
+CHECK_FIELD(xfs_bulk_ireq, icount);
+CHECK_FIELD(xfs_bulk_ireq, ocount);
+CHECK_FIELD(xfs_bulk_ireq, agno);
+CHECK_FIELD(xfs_bulk_ireq, reserved);
+
+CHECK_SIZE(xfs_bulkstat_req);
+CHECK_FIELD(xfs_bulkstat_req, hdr);
+_Static_assert(offsetof(struct xfs_bulkstat_req, bulkstat) ==
+	       offsetof(struct cfd_xfs_bulkstat_req, bulkstat),
+	       "xfs_bulkstat_req.bulkstat is in the wrong place");
+
+/* XFS_IOC_BULKSTAT is now ours; the system's is built the same way */
+_Static_assert(XFS_IOC_BULKSTAT ==
+	       _IOR('X', 127, struct xfs_bulkstat_req),
+	       "XFS_IOC_BULKSTAT is the wrong ioctl");
+
+int main(void)
+{
+	printf("XFS bulkstat layout matches <xfs/xfs_fs.h>\n");
+	return 0;
+}